@@ -1,16 +1,20 @@
 #include "ksocket.h"
 
-pthread_t receiver_thread_id, sender_thread_id;
+extern KTPTable *ktp_table;
 
-void *receiver_thread(void *arg);
-void *sender_thread(void *arg);
-void garbage_collector(int signum);
+pthread_t worker_thread_ids[KTP_MAX_WORKERS], command_thread_id;
+
+void *worker_thread(void *arg);
+void *command_thread(void *arg);
 
 int main() {
-    init_shared_memory();
-    pthread_create(&receiver_thread_id, NULL, receiver_thread, NULL);
-    pthread_create(&sender_thread_id, NULL, sender_thread, NULL);
-    signal(SIGTERM, garbage_collector);
+    init_engine();
+    for (long n = 0; n < ktp_table->nworkers; n++) {
+        pthread_create(&worker_thread_ids[n], NULL, worker_thread, (void *)n);
+    }
+    pthread_create(&command_thread_id, NULL, command_thread, NULL);
+    printf("Protocol engine running with %d workers (%s)\n", ktp_table->nworkers,
+           ktp_table->io_backend == KTP_IO_URING ? "io_uring" : "epoll");
     while (1) {
         sleep(1); 
     }
@@ -1,257 +1,3657 @@
+#define _GNU_SOURCE
 #include "ksocket.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <netinet/udp.h>
 
-KTPSocket *shared_memory;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-fd_set read_fds, write_fds;
-int max_fd = 0;
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 
+KTPTable *ktp_table;
+
+/* The XOR of count messages from sequence number first on, and of their
+ * lengths; data is zero-padded beyond length, the longest of them. */
+typedef struct {
+    uint32_t first;
+    uint16_t count;
+    uint16_t length_xor;
+    uint16_t length;
+    char data[MESSAGE_SIZE];
+} KTPParityBlock;
+
+/* Forward error correction state of one socket, kept by the engine and
+ * allocated the first time the socket sends or receives parity. The sender
+ * XORs each new message into block and sends its parity once k messages
+ * are in. The receiver keeps parity it cannot use yet, because two of its
+ * block are still missing, and copies of the last KTP_FEC_MAX_K messages
+ * delivered, since a block may start before next_seq. */
+typedef struct {
+    int k;
+    /* The KTP_FEC setting block was started under. */
+    int setting;
+    uint64_t epoch_packets;
+    uint64_t epoch_retransmits;
+    KTPParityBlock block;
+    KTPParityBlock pending[KTP_FEC_PENDING];
+    int next_pending;
+    int recording;
+    struct {
+        uint32_t seq_num;
+        int valid;
+        uint16_t length;
+        char data[MESSAGE_SIZE];
+    } history[KTP_FEC_MAX_K];
+} KTPFec;
+
+/* A listening socket's connections, hashed by peer address and chained
+ * through their next_peer; only touched with the listener's lock held. */
+typedef struct {
+    int *buckets;
+    uint32_t mask;
+    int count;
+} KTPPeerTable;
+
+/* This process's view of one chunk of the socket table: its attachment plus
+ * process-local per-socket state. Allocated the first time the process
+ * touches the chunk and never moved or freed. */
+typedef struct {
+    KTPSocket *sockets;
+    uint64_t timer_deadline[KTP_CHUNK_SOCKETS];
+    int timer_pos[KTP_CHUNK_SOCKETS];
+    unsigned char expired[KTP_CHUNK_SOCKETS];
+    /* Attachment of each socket's slot segment; only touched with the
+     * socket's lock held. */
+    struct {
+        int shmid;
+        char *base;
+    } slot_cache[KTP_CHUNK_SOCKETS];
+    /* Engine only. */
+    KTPFec *fec[KTP_CHUNK_SOCKETS];
+    KTPPeerTable *peers[KTP_CHUNK_SOCKETS];
+    /* Engine only, with the io_uring backend: the generation of the
+     * socket's multishot receive and whether one is posted. */
+    uint32_t recv_gen[KTP_CHUNK_SOCKETS];
+    unsigned char recv_armed[KTP_CHUNK_SOCKETS];
+} KTPChunk;
+
+KTPChunk *chunks[KTP_MAX_CHUNKS];
+pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A worker's retransmission timers: a heap of socket ids ordered by
+ * deadline. lock is never held across a socket lock acquisition or a
+ * syscall. */
+typedef struct {
+    pthread_mutex_t lock;
+    int *heap;
+    int size;
+    int capacity;
+} KTPTimerHeap;
+
+/* Engine only, one per worker. */
+KTPTimerHeap *timer_heaps;
+
+KTPChunk *ktp_chunk(int id);
+KTPSocket *ktp_socket(int id);
+void wake_socket(int i);
+
+#define TIMER_HEAP(id) (&timer_heaps[ktp_socket(id)->worker])
+#define TIMER_DEADLINE(id) (ktp_chunk(id)->timer_deadline[(id) % KTP_CHUNK_SOCKETS])
+#define TIMER_POS(id) (ktp_chunk(id)->timer_pos[(id) % KTP_CHUNK_SOCKETS])
+#define SLOT_CACHE(id) (ktp_chunk(id)->slot_cache[(id) % KTP_CHUNK_SOCKETS])
+#define FEC_STATE(id) (ktp_chunk(id)->fec[(id) % KTP_CHUNK_SOCKETS])
+#define PEER_TABLE(id) (ktp_chunk(id)->peers[(id) % KTP_CHUNK_SOCKETS])
+#define RECV_GEN(id) (ktp_chunk(id)->recv_gen[(id) % KTP_CHUNK_SOCKETS])
+#define RECV_ARMED(id) (ktp_chunk(id)->recv_armed[(id) % KTP_CHUNK_SOCKETS])
+
+#define SEND_SLOT(sock, off) (((sock)->swnd.head + (off)) % (sock)->snd_wnd)
+#define RECV_SLOT(sock, off) (((sock)->recv_head + (off)) % (sock)->rcv_wnd)
+#define BITMAP_WORDS(rcv_wnd) (((rcv_wnd) + 63) / 64)
+#define STAT_ADD(sock, field, n) __atomic_fetch_add(&(sock)->stats.field, (n), __ATOMIC_RELAXED)
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Waits while *addr == val, for at most timeout_ns (0 = no limit). The
+ * futexes live in the shared table, so they are not FUTEX_PRIVATE. */
+static int futex_wait(uint32_t *addr, uint32_t val, uint64_t timeout_ns) {
+    struct timespec ts = {timeout_ns / 1000000000ULL, timeout_ns % 1000000000ULL};
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_ns ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void timer_swap(KTPTimerHeap *timers, int a, int b) {
+    int tmp = timers->heap[a];
+    timers->heap[a] = timers->heap[b];
+    timers->heap[b] = tmp;
+    TIMER_POS(timers->heap[a]) = a;
+    TIMER_POS(timers->heap[b]) = b;
+}
+
+static void timer_sift(KTPTimerHeap *timers, int pos) {
+    int *heap = timers->heap;
+    while (pos > 0 && TIMER_DEADLINE(heap[pos]) < TIMER_DEADLINE(heap[(pos - 1) / 2])) {
+        timer_swap(timers, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+    while (1) {
+        int smallest = pos;
+        int left = 2 * pos + 1, right = 2 * pos + 2;
+        if (left < timers->size && TIMER_DEADLINE(heap[left]) < TIMER_DEADLINE(heap[smallest])) {
+            smallest = left;
+        }
+        if (right < timers->size && TIMER_DEADLINE(heap[right]) < TIMER_DEADLINE(heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            break;
+        }
+        timer_swap(timers, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void timer_remove(KTPTimerHeap *timers, int sockfd) {
+    int pos = TIMER_POS(sockfd);
+    if (pos < 0) {
+        return;
+    }
+    timer_swap(timers, pos, --timers->size);
+    TIMER_POS(sockfd) = -1;
+    if (pos < timers->size) {
+        timer_sift(timers, pos);
+    }
+}
+
+/* Arms (or re-arms) the retransmission timer of a socket. */
+void timer_schedule(int sockfd, uint64_t deadline) {
+    KTPTimerHeap *timers = TIMER_HEAP(sockfd);
+    pthread_mutex_lock(&timers->lock);
+    TIMER_DEADLINE(sockfd) = deadline;
+    if (TIMER_POS(sockfd) < 0) {
+        if (timers->size == timers->capacity) {
+            timers->capacity = timers->capacity ? 2 * timers->capacity : KTP_CHUNK_SOCKETS;
+            timers->heap = realloc(timers->heap, timers->capacity * sizeof(int));
+            if (timers->heap == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        TIMER_POS(sockfd) = timers->size;
+        timers->heap[timers->size++] = sockfd;
+    }
+    timer_sift(timers, TIMER_POS(sockfd));
+    int earliest = timers->heap[0] == sockfd;
+    pthread_mutex_unlock(&timers->lock);
+    if (earliest) {
+        wake_socket(sockfd);
+    }
+}
+
+/* Pulls a socket's timer forward to deadline if it is not already due
+ * sooner; used for pacing, which must not delay a retransmission. */
+void timer_schedule_before(int sockfd, uint64_t deadline) {
+    KTPTimerHeap *timers = TIMER_HEAP(sockfd);
+    pthread_mutex_lock(&timers->lock);
+    int later = TIMER_POS(sockfd) < 0 || deadline < TIMER_DEADLINE(sockfd);
+    pthread_mutex_unlock(&timers->lock);
+    if (later) {
+        timer_schedule(sockfd, deadline);
+    }
+}
+
+void timer_cancel(int sockfd) {
+    KTPTimerHeap *timers = TIMER_HEAP(sockfd);
+    pthread_mutex_lock(&timers->lock);
+    timer_remove(timers, sockfd);
+    pthread_mutex_unlock(&timers->lock);
+}
+
+int timer_armed(int sockfd) {
+    KTPTimerHeap *timers = TIMER_HEAP(sockfd);
+    pthread_mutex_lock(&timers->lock);
+    int armed = TIMER_POS(sockfd) >= 0;
+    pthread_mutex_unlock(&timers->lock);
+    return armed;
+}
+
+/* The worker a thread of the engine runs, so that it does not ring its own
+ * doorbell; -1 in every other thread. */
+static __thread int current_worker = -1;
+
+/* The engine's view of the workers' trace rings, one per worker. */
+static KTPTraceRing *trace_rings;
+
+/* Records an event in the calling worker's trace ring when the table's
+ * trace_level is at least level; below it, tracing costs one load and a
+ * branch. Events raised outside a worker are not recorded. */
+#define TRACE(level, i, type, seq, window)                                                  \
+    do {                                                                                     \
+        if (__builtin_expect(__atomic_load_n(&ktp_table->trace_level, __ATOMIC_RELAXED) >= \
+                             (level), 0)) {                                                  \
+            trace_event((i), (type), (seq), (window));                                       \
+        }                                                                                    \
+    } while (0)
+
+/* The worker is the ring's only writer: it fills in the slot and then
+ * publishes it by advancing head. A reader that copied a slot while it was
+ * being overwritten sees head move and drops it (see ktptrace). */
+static void trace_event(int i, int type, uint32_t seq, uint32_t window) {
+    if (current_worker < 0) {
+        return;
+    }
+    KTPTraceRing *ring = &trace_rings[current_worker];
+    uint64_t n = ring->head;
+    KTPTraceEvent *event = &ring->events[n % KTP_TRACE_EVENTS];
+    event->time_ns = monotonic_ns();
+    event->sockfd = i;
+    event->type = type;
+    event->worker = current_worker;
+    event->seq = seq;
+    event->window = window;
+    __atomic_store_n(&ring->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/* This process's socket for ringing doorbells, opened on first use. */
+static int doorbell_fd = -1;
+
+static void ring_doorbell(KTPWorker *worker) {
+    int fd = __atomic_load_n(&doorbell_fd, __ATOMIC_ACQUIRE);
+    if (fd == -1) {
+        int expected = -1;
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            perror("socket");
+            return;
+        }
+        if (!__atomic_compare_exchange_n(&doorbell_fd, &expected, fd, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            close(fd);
+            fd = expected;
+        }
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = worker->doorbell_port;
+    sendto(fd, "", 0, MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+/* Tells a worker that one of its sockets has new data, ACKs or window to
+ * use; callable from any process. Workers sleep in epoll_wait, so the
+ * doorbell (an empty datagram) is only rung when the worker is actually
+ * asleep; a worker waking itself just keeps it from sleeping. */
+void wake_worker(int w) {
+    KTPWorker *worker = &ktp_table->workers[w];
+    __atomic_fetch_add(&worker->work, 1, __ATOMIC_SEQ_CST);
+    if (w != current_worker && __atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST)) {
+        ring_doorbell(worker);
+    }
+}
+
+void wake_socket(int i) {
+    wake_worker(ktp_socket(i)->worker);
+}
+
+static int rtt_bucket(uint64_t sample) {
+    uint64_t us = sample / 1000;
+    int k = 0;
+    while (us > 1 && k < KTP_RTT_BUCKETS - 1) {
+        us >>= 1;
+        k++;
+    }
+    return k;
+}
+
+/* RFC 6298 estimator; only called for samples that pass Karn's rule. */
+void rtt_sample(KTPSocket *sock, uint64_t sample) {
+    STAT_ADD(sock, rtt_hist[rtt_bucket(sample)], 1);
+    if (sock->rtt.srtt == 0) {
+        sock->rtt.srtt = sample;
+        sock->rtt.rttvar = sample / 2;
+    } else {
+        uint64_t delta = sock->rtt.srtt > sample ? sock->rtt.srtt - sample : sample - sock->rtt.srtt;
+        sock->rtt.rttvar = (3 * sock->rtt.rttvar + delta) / 4;
+        sock->rtt.srtt = (7 * sock->rtt.srtt + sample) / 8;
+    }
+    uint64_t rto = sock->rtt.srtt + 4 * sock->rtt.rttvar;
+    if (rto < RTO_MIN_MS * 1000000ULL) {
+        rto = RTO_MIN_MS * 1000000ULL;
+    }
+    if (rto > RTO_MAX_MS * 1000000ULL) {
+        rto = RTO_MAX_MS * 1000000ULL;
+    }
+    sock->rtt.rto = rto;
+    sock->rtt.backoff = 0;
+}
+
+/* Congestion control. Each algorithm only adjusts cwnd and ssthresh;
+ * recovery state, pacing and the counters are shared. The state lives in
+ * shared memory, so sockets record an index into cc_ops rather than a
+ * pointer. All hooks run with the socket lock held. */
+typedef struct {
+    const char *name;
+    void (*init)(KTPSocket *sock);
+    void (*on_ack)(KTPSocket *sock, uint32_t acked, uint64_t rtt);
+    void (*on_loss)(KTPSocket *sock);
+    void (*on_timeout)(KTPSocket *sock);
+} KTPCongestionOps;
+
+static uint32_t cc_half_flight(KTPSocket *sock) {
+    uint32_t half = sock->swnd.size / 2;
+    return half < KTP_MIN_CWND ? KTP_MIN_CWND : half;
+}
+
+static void cc_reset(KTPSocket *sock) {
+    sock->cc.cwnd = KTP_INIT_CWND;
+    sock->cc.ssthresh = KTP_MAX_WINDOW;
+    sock->cc.cwnd_cnt = 0;
+}
+
+/* NewReno: slow start to ssthresh, then one message per window of ACKs;
+ * halve on loss, restart from one message on timeout. */
+static void newreno_on_ack(KTPSocket *sock, uint32_t acked, uint64_t rtt) {
+    if (sock->cc.cwnd < sock->cc.ssthresh) {
+        sock->cc.cwnd += acked;
+        if (sock->cc.cwnd > sock->cc.ssthresh) {
+            sock->cc.cwnd = sock->cc.ssthresh;
+        }
+        return;
+    }
+    sock->cc.cwnd_cnt += acked;
+    if (sock->cc.cwnd_cnt >= sock->cc.cwnd) {
+        sock->cc.cwnd_cnt -= sock->cc.cwnd;
+        sock->cc.cwnd++;
+    }
+}
+
+static void newreno_on_loss(KTPSocket *sock) {
+    sock->cc.ssthresh = cc_half_flight(sock);
+    sock->cc.cwnd = sock->cc.ssthresh;
+    sock->cc.cwnd_cnt = 0;
+}
+
+static void newreno_on_timeout(KTPSocket *sock) {
+    sock->cc.ssthresh = cc_half_flight(sock);
+    sock->cc.cwnd = 1;
+    sock->cc.cwnd_cnt = 0;
+}
+
+/* Delay-based (Vegas): once per round trip, estimate how many messages are
+ * queued in the path, cwnd * (rtt - min_rtt) / rtt, and keep it between
+ * DELAY_ALPHA and DELAY_BETA. Slow start ends as soon as a queue forms. */
+#define DELAY_ALPHA 2
+#define DELAY_BETA 4
+
+static void delay_on_ack(KTPSocket *sock, uint32_t acked, uint64_t rtt) {
+    if (rtt != 0 && (sock->cc.epoch_rtt == 0 || rtt < sock->cc.epoch_rtt)) {
+        sock->cc.epoch_rtt = rtt;
+    }
+    if (sock->cc.cwnd < sock->cc.ssthresh) {
+        sock->cc.cwnd += acked;
+    }
+    if (SEQ_LT(sock->swnd.cum_ack, sock->cc.epoch_seq) || sock->cc.epoch_rtt == 0) {
+        return;
+    }
+
+    uint64_t queued = sock->cc.cwnd * (sock->cc.epoch_rtt - sock->cc.min_rtt) / sock->cc.epoch_rtt;
+    if (sock->cc.cwnd < sock->cc.ssthresh) {
+        if (queued > 1) {
+            sock->cc.cwnd = sock->cc.cwnd * sock->cc.min_rtt / sock->cc.epoch_rtt + 1;
+            sock->cc.ssthresh = sock->cc.cwnd;
+        }
+    } else if (queued < DELAY_ALPHA) {
+        sock->cc.cwnd++;
+    } else if (queued > DELAY_BETA && sock->cc.cwnd > KTP_MIN_CWND) {
+        sock->cc.cwnd--;
+    }
+    sock->cc.epoch_seq = sock->next_seq_num;
+    sock->cc.epoch_rtt = 0;
+}
+
+static void delay_on_loss(KTPSocket *sock) {
+    uint32_t cwnd = sock->cc.cwnd * 3 / 4;
+    sock->cc.cwnd = cwnd < KTP_MIN_CWND ? KTP_MIN_CWND : cwnd;
+    sock->cc.ssthresh = sock->cc.cwnd;
+}
+
+static const KTPCongestionOps cc_ops[] = {
+    [KTP_CC_NEWRENO] = {"newreno", cc_reset, newreno_on_ack, newreno_on_loss, newreno_on_timeout},
+    [KTP_CC_DELAY] = {"delay", cc_reset, delay_on_ack, delay_on_loss, newreno_on_timeout},
+};
+
+#define CC_ALGORITHMS (int)(sizeof(cc_ops) / sizeof(cc_ops[0]))
+
+/* Selects an algorithm and starts it from a fresh window and counters. */
+void cc_init(KTPSocket *sock, int algorithm) {
+    memset(&sock->cc, 0, sizeof(sock->cc));
+    sock->cc.algorithm = algorithm;
+    sock->cc.epoch_seq = sock->next_seq_num;
+    cc_ops[algorithm].init(sock);
+}
+
+void cc_on_ack(KTPSocket *sock, uint32_t acked, uint64_t rtt) {
+    uint32_t cwnd = sock->cc.cwnd;
+    if (rtt != 0 && (sock->cc.min_rtt == 0 || rtt < sock->cc.min_rtt)) {
+        sock->cc.min_rtt = rtt;
+    }
+    if (!sock->cc.in_recovery) {
+        cc_ops[sock->cc.algorithm].on_ack(sock, acked, rtt);
+    }
+    if (sock->cc.cwnd > KTP_MAX_WINDOW) {
+        sock->cc.cwnd = KTP_MAX_WINDOW;
+    }
+    if (sock->cc.cwnd < cwnd) {
+        sock->cc.cwnd_reductions++;
+    }
+}
+
+/* Entered on fast retransmit. Only the first loss of a window reduces cwnd;
+ * recovery lasts until everything sent before it has been acknowledged. */
+void cc_on_loss(KTPSocket *sock) {
+    sock->cc.fast_retransmits++;
+    if (sock->cc.in_recovery) {
+        return;
+    }
+    sock->cc.in_recovery = 1;
+    sock->cc.recover = sock->next_seq_num;
+    cc_ops[sock->cc.algorithm].on_loss(sock);
+    sock->cc.cwnd_reductions++;
+}
+
+void cc_on_timeout(KTPSocket *sock) {
+    sock->cc.timeouts++;
+    sock->cc.in_recovery = 0;
+    cc_ops[sock->cc.algorithm].on_timeout(sock);
+    sock->cc.cwnd_reductions++;
+}
+
+/* Spacing between new transmissions so that a window goes out over one
+ * smoothed RTT, sped up in slow start so the window can still grow. Zero
+ * (no pacing) until the first RTT sample. */
+uint64_t pacing_interval(KTPSocket *sock) {
+    if (sock->rtt.srtt == 0) {
+        return 0;
+    }
+    uint64_t gain = sock->cc.cwnd < sock->cc.ssthresh ? 200 : 125;
+    return sock->rtt.srtt * 100 / (sock->cc.cwnd * gain);
+}
+
+static int engine_alive() {
+    pid_t pid = __atomic_load_n(&ktp_table->engine_pid, __ATOMIC_ACQUIRE);
+    return pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+/* The table's SysV key; KTP_SHM_KEY in the environment selects another
+ * table, so test engines can run beside the production one. */
+static key_t table_key() {
+    const char *env = getenv("KTP_SHM_KEY");
+    return env != NULL ? (key_t)strtol(env, NULL, 0) : KTP_SHM_KEY;
+}
+
+/* Attaches an application to the socket table set up by initksocket.
+ * Returns -1 with errno ECONNREFUSED if no engine is running. */
 int init_shared_memory() {
-    key_t key = ftok("ksocket", 'R');
-    int shmid = shmget(key, sizeof(KTPSocket) * MAX_KTP_SOCKETS, 0666 | IPC_CREAT);
+    int shmid = shmget(table_key(), sizeof(KTPTable), 0666);
+    if (shmid == -1) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    ktp_table = (KTPTable *)shmat(shmid, NULL, 0);
+    if (ktp_table == (void *)-1) {
+        ktp_table = NULL;
+        return -1;
+    }
+    if (!engine_alive()) {
+        shmdt(ktp_table);
+        ktp_table = NULL;
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    return 0;
+}
+
+static void init_workers();
+
+/* Creates the socket table for initksocket, the only process that runs the
+ * protocol engine. Sockets left by an engine that has exited died with it,
+ * so the table always starts out empty. */
+int init_engine() {
+    int shmid = shmget(table_key(), sizeof(KTPTable), 0666 | IPC_CREAT);
+    if (shmid == -1 && errno == EINVAL) {
+        /* Left over from a build with a smaller table. */
+        shmctl(shmget(table_key(), 0, 0666), IPC_RMID, NULL);
+        shmid = shmget(table_key(), sizeof(KTPTable), 0666 | IPC_CREAT);
+    }
     if (shmid == -1) {
         perror("shmget");
         exit(1);
     }
-    shared_memory = (KTPSocket *)shmat(shmid, NULL, 0);
-    if (shared_memory == (void *)-1) {
+    ktp_table = (KTPTable *)shmat(shmid, NULL, 0);
+    if (ktp_table == (void *)-1) {
         perror("shmat");
         exit(1);
     }
-    for (int i = 0; i < MAX_KTP_SOCKETS; i++) {
-        shared_memory[i].is_free = 1;
+    if (engine_alive()) {
+        fprintf(stderr, "initksocket is already running (pid %d)\n", ktp_table->engine_pid);
+        exit(1);
     }
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
+
+    memset(ktp_table, 0, sizeof(KTPTable));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&ktp_table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    ktp_table->free_head = -1;
+    ktp_table->active_head = -1;
+
+    init_workers();
+    __atomic_store_n(&ktp_table->engine_pid, getpid(), __ATOMIC_RELEASE);
     return 0;
 }
 
-void send_ack(int sockfd, unsigned char seq_num, int rwnd_size, int nospace) {
-    KTPHeader header = {seq_num, (unsigned char)rwnd_size, 1, (unsigned char)nospace};
-    char packet[sizeof(KTPHeader)];
-    memcpy(packet, &header, sizeof(KTPHeader));
-    sendto(shared_memory[sockfd].udp_socket, packet, sizeof(KTPHeader), 0, 
-           (struct sockaddr *)&shared_memory[sockfd].remote_addr, sizeof(struct sockaddr_in));
+/* Returns this process's view of the chunk holding socket id, attaching the
+ * chunk's segment on first use. */
+KTPChunk *ktp_chunk(int id) {
+    int c = id / KTP_CHUNK_SOCKETS;
+    KTPChunk *chunk = __atomic_load_n(&chunks[c], __ATOMIC_ACQUIRE);
+    if (chunk != NULL) {
+        return chunk;
+    }
+
+    pthread_mutex_lock(&chunk_lock);
+    chunk = chunks[c];
+    if (chunk == NULL) {
+        chunk = calloc(1, sizeof(KTPChunk));
+        if (chunk == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        chunk->sockets = shmat(ktp_table->chunk_shmid[c], NULL, 0);
+        if (chunk->sockets == (void *)-1) {
+            perror("shmat");
+            exit(1);
+        }
+        for (int k = 0; k < KTP_CHUNK_SOCKETS; k++) {
+            chunk->timer_pos[k] = -1;
+            chunk->slot_cache[k].shmid = -1;
+        }
+        __atomic_store_n(&chunks[c], chunk, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&chunk_lock);
+    return chunk;
 }
 
-void *receiver_thread(void *arg) {
-    while (1) {
-        fd_set temp_read_fds = read_fds;
-        struct timeval timeout = {T, 0};
-        int ready = select(max_fd + 1, &temp_read_fds, NULL, NULL, &timeout);
-
-        if (ready > 0) {
-            for (int i = 0; i < MAX_KTP_SOCKETS; i++) {
-                if (!shared_memory[i].is_free && FD_ISSET(shared_memory[i].udp_socket, &temp_read_fds)) {
-                    char buffer[MESSAGE_SIZE + sizeof(KTPHeader)];
-                    struct sockaddr_in src_addr;
-                    socklen_t src_len = sizeof(src_addr);
-                    ssize_t bytes_received = recvfrom(shared_memory[i].udp_socket, buffer, 
-                                             MESSAGE_SIZE + sizeof(KTPHeader), 0, 
-                                             (struct sockaddr *)&src_addr, &src_len);
-                    if (bytes_received < 0) {
-                        perror("recvfrom");
-                        continue;
-                    }
+KTPSocket *ktp_socket(int id) {
+    return &ktp_chunk(id)->sockets[id % KTP_CHUNK_SOCKETS];
+}
 
-                    if (dropMessage(P)) {
-                        printf("Dropping message \n");
-                        continue; 
-                    }
+/* Adds a chunk of KTP_CHUNK_SOCKETS free sockets to the table. Caller holds
+ * the table lock. */
+static int grow_table() {
+    if (ktp_table->nchunks == KTP_MAX_CHUNKS) {
+        return -1;
+    }
+    int c = ktp_table->nchunks;
+    int shmid = shmget(IPC_PRIVATE, KTP_CHUNK_SOCKETS * sizeof(KTPSocket), 0666 | IPC_CREAT);
+    if (shmid == -1) {
+        return -1;
+    }
+    ktp_table->chunk_shmid[c] = shmid;
+    KTPSocket *sockets = ktp_chunk(c * KTP_CHUNK_SOCKETS)->sockets;
+    /* Applications can still attach by id; the kernel frees the chunk once
+     * the engine and every application have detached. */
+    shmctl(shmid, IPC_RMID, NULL);
+    for (int k = KTP_CHUNK_SOCKETS - 1; k >= 0; k--) {
+        sockets[k].in_use = 0;
+        sockets[k].is_free = 1;
+        sockets[k].next_free = ktp_table->free_head;
+        ktp_table->free_head = c * KTP_CHUNK_SOCKETS + k;
+    }
+    ktp_table->nchunks++;
+    ktp_table->capacity += KTP_CHUNK_SOCKETS;
+    return 0;
+}
 
-                    KTPHeader *header = (KTPHeader *)buffer;
-                    
-                    if (header->is_ack) {
-                        pthread_mutex_lock(&mutex);
-                        int found = 0;
-                        for (int j = 0; j < shared_memory[i].swnd.size; j++) {
-                            if (shared_memory[i].swnd.seq_nums[j] == header->seq_num) {
-                                found = 1;
-                                for (int k = j; k < shared_memory[i].swnd.size - 1; k++) {
-                                    shared_memory[i].swnd.seq_nums[k] = shared_memory[i].swnd.seq_nums[k + 1];
-                                    shared_memory[i].swnd.send_times[k] = shared_memory[i].swnd.send_times[k + 1];
-                                    memcpy(shared_memory[i].send_buffer[k], shared_memory[i].send_buffer[k + 1], MESSAGE_SIZE);
-                                }
-                                shared_memory[i].swnd.size--;
-                                printf("ACK received for seq %d, swnd size now %d\n", header->seq_num, shared_memory[i].swnd.size);
-                                break;
-                            }
-                        }
-                        if (!found) {
-                            printf("Received ACK for unknown sequence number %d\n", header->seq_num);
-                        }
-                        shared_memory[i].rwnd.size = header->rwnd_size;
-                        shared_memory[i].nospace_flag = header->is_nospace;
-                        pthread_mutex_unlock(&mutex);
-                    } else {
-                        pthread_mutex_lock(&mutex);
-                        unsigned char seq_num = header->seq_num;
-                        
-                        if (shared_memory[i].recv_buffer_size < BUFFER_SIZE) {
-                            int duplicate = 0;
-                            for (int j = 0; j < shared_memory[i].rwnd.size; j++) {
-                                if (shared_memory[i].rwnd.seq_nums[j] == seq_num) {
-                                    duplicate = 1;
-                                    break;
-                                }
-                            }
-                            
-                            if (!duplicate) {
-                                memcpy(shared_memory[i].recv_buffer[shared_memory[i].recv_buffer_size], 
-                                       buffer + sizeof(KTPHeader), 
-                                       bytes_received - sizeof(KTPHeader));
-                                
-                                shared_memory[i].rwnd.seq_nums[shared_memory[i].rwnd.size] = seq_num;
-                                shared_memory[i].rwnd.size++;
-                                shared_memory[i].recv_buffer_size++;
-                                shared_memory[i].last_ack_seq = seq_num;
-                                
-                                printf("Received packet seq %d, recv_buffer_size now %d\n", 
-                                      seq_num, shared_memory[i].recv_buffer_size);
-                            } else {
-                                printf("Duplicate packet seq %d ignored\n", seq_num);
-                            }
-                            
-                            int available_space = BUFFER_SIZE - shared_memory[i].recv_buffer_size;
-                            send_ack(i, seq_num, available_space, 0);
-                        } else {
-                            shared_memory[i].nospace_flag = 1;
-                            send_ack(i, shared_memory[i].last_ack_seq, 0, 1);
-                            printf("No space in receive buffer, sending NOSPACE ACK\n");
-                        }
-                        pthread_mutex_unlock(&mutex);
-                    }
-                }
-            }
-        } else if (ready == 0) {
-            pthread_mutex_lock(&mutex);
-            for (int i = 0; i < MAX_KTP_SOCKETS; i++) {
-                if (!shared_memory[i].is_free && shared_memory[i].nospace_flag && 
-                    shared_memory[i].recv_buffer_size < BUFFER_SIZE) {
-                    int available_space = BUFFER_SIZE - shared_memory[i].recv_buffer_size;
-                    shared_memory[i].nospace_flag = 0;
-                    send_ack(i, shared_memory[i].last_ack_seq, available_space, 0);
-                    printf("Space now available in receive buffer, sending ACK\n");
-                }
-            }
-            pthread_mutex_unlock(&mutex);
+/* Takes a socket off the free list and puts it on the active list. Returns
+ * its id, or -1 if the table cannot grow. */
+static int alloc_socket() {
+    pthread_mutex_lock(&ktp_table->lock);
+    if (ktp_table->free_head == -1 && grow_table() == -1) {
+        pthread_mutex_unlock(&ktp_table->lock);
+        return -1;
+    }
+    int id = ktp_table->free_head;
+    KTPSocket *sock = ktp_socket(id);
+    ktp_table->free_head = sock->next_free;
+
+    sock->prev_active = -1;
+    sock->next_active = ktp_table->active_head;
+    if (ktp_table->active_head != -1) {
+        ktp_socket(ktp_table->active_head)->prev_active = id;
+    }
+    ktp_table->active_head = id;
+    ktp_table->active_count++;
+    sock->in_use = 1;
+    pthread_mutex_unlock(&ktp_table->lock);
+    return id;
+}
+
+/* Moves a closed socket from the active list back to the free list. */
+static void release_socket(int id) {
+    KTPSocket *sock = ktp_socket(id);
+    pthread_mutex_lock(&ktp_table->lock);
+    if (sock->prev_active != -1) {
+        ktp_socket(sock->prev_active)->next_active = sock->next_active;
+    } else {
+        ktp_table->active_head = sock->next_active;
+    }
+    if (sock->next_active != -1) {
+        ktp_socket(sock->next_active)->prev_active = sock->prev_active;
+    }
+    ktp_table->active_count--;
+    sock->in_use = 0;
+    sock->next_free = ktp_table->free_head;
+    ktp_table->free_head = id;
+    pthread_mutex_unlock(&ktp_table->lock);
+}
+
+/* Collects the ids of the open sockets into *ids (grown as needed) and
+ * returns how many there are. Only the active list is walked, so the cost
+ * follows the number of open sockets. */
+static int active_sockets(int **ids, int *capacity) {
+    int count = 0;
+
+    pthread_mutex_lock(&ktp_table->lock);
+    if (*capacity < ktp_table->active_count) {
+        *capacity = ktp_table->active_count;
+        *ids = realloc(*ids, *capacity * sizeof(int));
+        if (*ids == NULL) {
+            perror("realloc");
+            exit(1);
         }
     }
-    return NULL;
+    for (int id = ktp_table->active_head; id != -1; id = ktp_socket(id)->next_active) {
+        if (!ktp_socket(id)->is_free) {
+            (*ids)[count++] = id;
+        }
+    }
+    pthread_mutex_unlock(&ktp_table->lock);
+    return count;
+}
+
+/* Creates and attaches a slot segment for the given window sizes. It is
+ * marked for removal immediately, so the kernel frees it once the last
+ * process detaches. Returns the shmid or -1. */
+int create_slots(int snd_wnd, int rcv_wnd, char **base) {
+    size_t rings = snd_wnd * sizeof(KTPSendSlot) + rcv_wnd * sizeof(KTPRecvSlot) +
+                   BITMAP_WORDS(rcv_wnd) * sizeof(uint64_t);
+    size_t size = rings + 3 * rcv_wnd * sizeof(uint16_t);
+    int shmid = shmget(IPC_PRIVATE, size, 0666 | IPC_CREAT);
+    if (shmid == -1) {
+        return -1;
+    }
+    *base = shmat(shmid, NULL, 0);
+    if (*base == (void *)-1) {
+        shmctl(shmid, IPC_RMID, NULL);
+        return -1;
+    }
+    shmctl(shmid, IPC_RMID, NULL);
+
+    uint16_t *free_ring = (uint16_t *)(*base + rings + rcv_wnd * sizeof(uint16_t));
+    for (int k = 0; k < rcv_wnd; k++) {
+        free_ring[k] = k;
+    }
+    return shmid;
+}
+
+/* Swaps socket i's slot segment for a freshly created one and returns the
+ * previous attachment for the caller to shmdt() after unlocking. Caller
+ * holds the socket lock. */
+char *install_slots(int i, int shmid, char *base, int snd_wnd, int rcv_wnd) {
+    char *old = SLOT_CACHE(i).base;
+    SLOT_CACHE(i).shmid = shmid;
+    SLOT_CACHE(i).base = base;
+    ktp_socket(i)->slots_shmid = shmid;
+    ktp_socket(i)->snd_wnd = snd_wnd;
+    ktp_socket(i)->rcv_wnd = rcv_wnd;
+    ktp_socket(i)->recv_head = 0;
+    ktp_socket(i)->recv_buffer_size = 0;
+    ktp_socket(i)->recv_free_head = 0;
+    ktp_socket(i)->recv_free_count = rcv_wnd;
+    return old;
+}
+
+/* Returns socket i's slot storage, attaching the segment the first time this
+ * process touches the socket. Caller holds the socket lock. */
+char *socket_slots(int i) {
+    KTPSocket *sock = ktp_socket(i);
+    if (SLOT_CACHE(i).shmid != sock->slots_shmid || SLOT_CACHE(i).base == NULL) {
+        if (SLOT_CACHE(i).base != NULL) {
+            shmdt(SLOT_CACHE(i).base);
+        }
+        SLOT_CACHE(i).base = shmat(sock->slots_shmid, NULL, 0);
+        if (SLOT_CACHE(i).base == (void *)-1) {
+            perror("shmat");
+            exit(1);
+        }
+        SLOT_CACHE(i).shmid = sock->slots_shmid;
+    }
+    return SLOT_CACHE(i).base;
+}
+
+KTPSendSlot *send_slots(int i) {
+    return (KTPSendSlot *)socket_slots(i);
+}
+
+KTPRecvSlot *recv_slots(int i) {
+    return (KTPRecvSlot *)(socket_slots(i) + ktp_socket(i)->snd_wnd * sizeof(KTPSendSlot));
+}
+
+uint64_t *recv_bitmap(int i) {
+    return (uint64_t *)(socket_slots(i) + ktp_socket(i)->snd_wnd * sizeof(KTPSendSlot) +
+                        ktp_socket(i)->rcv_wnd * sizeof(KTPRecvSlot));
+}
+
+/* Receive slot numbers in delivery order, starting at recv_head. */
+uint16_t *recv_ring(int i) {
+    return (uint16_t *)(recv_bitmap(i) + BITMAP_WORDS(ktp_socket(i)->rcv_wnd));
+}
+
+/* Receive slot numbers that hold no message, starting at recv_free_head. */
+uint16_t *free_ring(int i) {
+    return recv_ring(i) + ktp_socket(i)->rcv_wnd;
+}
+
+/* Receive slot numbers of buffered messages not yet in order: sequence
+ * number s is held in slot recv_reorder(i)[s % rcv_wnd] while its received
+ * bit is set. */
+uint16_t *recv_reorder(int i) {
+    return free_ring(i) + ktp_socket(i)->rcv_wnd;
+}
+
+uint16_t free_slot_pop(int i) {
+    KTPSocket *sock = ktp_socket(i);
+    uint16_t slot = free_ring(i)[sock->recv_free_head];
+    sock->recv_free_head = (sock->recv_free_head + 1) % sock->rcv_wnd;
+    sock->recv_free_count--;
+    return slot;
+}
+
+void free_slot_push(int i, uint16_t slot) {
+    KTPSocket *sock = ktp_socket(i);
+    free_ring(i)[(sock->recv_free_head + sock->recv_free_count) % sock->rcv_wnd] = slot;
+    sock->recv_free_count++;
+}
+
+int received_bit(int i, uint32_t seq) {
+    uint32_t bit = seq % (BITMAP_WORDS(ktp_socket(i)->rcv_wnd) * 64);
+    return (recv_bitmap(i)[bit / 64] >> (bit % 64)) & 1;
+}
+
+void set_received_bit(int i, uint32_t seq, int value) {
+    uint32_t bit = seq % (BITMAP_WORDS(ktp_socket(i)->rcv_wnd) * 64);
+    if (value) {
+        recv_bitmap(i)[bit / 64] |= 1ULL << (bit % 64);
+    } else {
+        recv_bitmap(i)[bit / 64] &= ~(1ULL << (bit % 64));
+    }
 }
-void *sender_thread(void *arg) {
-    struct timespec ts;
-    ts.tv_sec = T / 2;
-    ts.tv_nsec = (T % 2) * 500000000; 
 
+/* A packet held back by the impairment layer until due. order breaks ties
+ * so packets due at the same time leave in the order they were queued. */
+typedef struct {
+    uint64_t due;
+    uint64_t order;
+    int sockfd;
+    int udp_socket;
+    struct sockaddr_in addr;
+    size_t len;
+    char data[sizeof(KTPHeader) + MESSAGE_SIZE];
+} KTPDelayed;
+
+/* A worker's held packets ordered by due time. lock is taken with a
+ * socket lock held, never the other way round. */
+typedef struct {
+    pthread_mutex_t lock;
+    KTPDelayed **heap;
+    int size;
+    int capacity;
+    uint64_t order;
+} KTPDelayHeap;
+
+/* Engine only, one per worker. */
+KTPDelayHeap *delay_heaps;
+
+#define DELAYED_BEFORE(a, b) ((a)->due < (b)->due || ((a)->due == (b)->due && (a)->order < (b)->order))
+
+static void delay_swap(KTPDelayHeap *delays, int a, int b) {
+    KTPDelayed *tmp = delays->heap[a];
+    delays->heap[a] = delays->heap[b];
+    delays->heap[b] = tmp;
+}
+
+static void delay_sift(KTPDelayHeap *delays, int pos) {
+    KTPDelayed **heap = delays->heap;
+    while (pos > 0 && DELAYED_BEFORE(heap[pos], heap[(pos - 1) / 2])) {
+        delay_swap(delays, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
     while (1) {
-        nanosleep(&ts, NULL);
-        pthread_mutex_lock(&mutex);
-        
-        for (int i = 0; i < MAX_KTP_SOCKETS; i++) {
-            if (!shared_memory[i].is_free) {
-                time_t current_time = time(NULL);
-                
-                for (int j = 0; j < shared_memory[i].swnd.size; j++) {
-                    if (current_time - shared_memory[i].swnd.send_times[j] >= T) {
-                        char packet[MESSAGE_SIZE + sizeof(KTPHeader)];
-                        KTPHeader header = {
-                            shared_memory[i].swnd.seq_nums[j], 
-                            0, 
-                            0, 
-                            0  
-                        };
-                        
-                        memcpy(packet, &header, sizeof(KTPHeader));
-                        memcpy(packet + sizeof(KTPHeader), shared_memory[i].send_buffer[j], MESSAGE_SIZE);
-                        
-                        if (shared_memory[i].udp_socket >= 0) {
-                            sendto(shared_memory[i].udp_socket, packet, MESSAGE_SIZE + sizeof(KTPHeader), 0,
-                                  (struct sockaddr *)&shared_memory[i].remote_addr, sizeof(struct sockaddr_in));
-                            
-                            shared_memory[i].swnd.send_times[j] = current_time;
-                            printf("Retransmitting packet seq %d\n", header.seq_num);
-                        } else {
-                            printf("Error: Invalid UDP socket for socket %d\n", i);
-                        }
-                    }
-                }
-                
-                while (shared_memory[i].swnd.size < BUFFER_SIZE && 
-                       shared_memory[i].send_buffer_size > 0 &&
-                       shared_memory[i].rwnd.size > 0) { 
-                    
-                    char packet[MESSAGE_SIZE + sizeof(KTPHeader)];
-                    unsigned char next_seq_num = shared_memory[i].next_seq_num;
-                    
-                    KTPHeader header = {
-                        next_seq_num, 
-                        0,  
-                        0,  
-                        0   
-                    };
-                    
-                    memcpy(packet, &header, sizeof(KTPHeader));
-                    
-                    memcpy(packet + sizeof(KTPHeader), 
-                           shared_memory[i].send_buffer[0], 
-                           MESSAGE_SIZE);
-                    
-                    if (shared_memory[i].udp_socket >= 0) {
-                        sendto(shared_memory[i].udp_socket, packet, MESSAGE_SIZE + sizeof(KTPHeader), 0,
-                              (struct sockaddr *)&shared_memory[i].remote_addr, sizeof(struct sockaddr_in));
-                        
-                        int idx = shared_memory[i].swnd.size;
-                        shared_memory[i].swnd.seq_nums[idx] = next_seq_num;
-                        shared_memory[i].swnd.send_times[idx] = current_time;
-                        
-                        memcpy(shared_memory[i].send_buffer[idx], 
-                               shared_memory[i].send_buffer[0],
-                               MESSAGE_SIZE);
-                        
-                        for (int j = 1; j < shared_memory[i].send_buffer_size; j++) {
-                            memcpy(shared_memory[i].send_buffer[j-1], 
-                                   shared_memory[i].send_buffer[j], 
-                                   MESSAGE_SIZE);
-                        }
-                        
-                        shared_memory[i].swnd.size++;
-                        shared_memory[i].send_buffer_size--;
-                        shared_memory[i].rwnd.size--; 
-                        shared_memory[i].next_seq_num = (next_seq_num + 1) % 256; 
-                        
-                        printf("Sent new packet seq %d, swnd size now %d\n", next_seq_num, shared_memory[i].swnd.size);
-                    } else {
-                        printf("Error: Invalid UDP socket for socket %d\n", i);
-                        break;
-                    }
-                }
+        int smallest = pos;
+        int left = 2 * pos + 1, right = 2 * pos + 2;
+        if (left < delays->size && DELAYED_BEFORE(heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < delays->size && DELAYED_BEFORE(heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            break;
+        }
+        delay_swap(delays, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void delay_push(KTPDelayHeap *delays, KTPDelayed *packet) {
+    pthread_mutex_lock(&delays->lock);
+    if (delays->size == delays->capacity) {
+        delays->capacity = delays->capacity ? 2 * delays->capacity : KTP_IMPAIR_LIMIT;
+        delays->heap = realloc(delays->heap, delays->capacity * sizeof(KTPDelayed *));
+        if (delays->heap == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    packet->order = delays->order++;
+    delays->heap[delays->size++] = packet;
+    delay_sift(delays, delays->size - 1);
+    pthread_mutex_unlock(&delays->lock);
+}
+
+/* Removes and returns the first packet if it is due by now. */
+static KTPDelayed *delay_pop(KTPDelayHeap *delays, uint64_t now) {
+    pthread_mutex_lock(&delays->lock);
+    KTPDelayed *packet = NULL;
+    if (delays->size > 0 && delays->heap[0]->due <= now) {
+        packet = delays->heap[0];
+        delays->heap[0] = delays->heap[--delays->size];
+        delay_sift(delays, 0);
+    }
+    pthread_mutex_unlock(&delays->lock);
+    return packet;
+}
+
+/* Returns when the first held packet is due, or 0 if none is held. */
+static uint64_t delay_next_due(KTPDelayHeap *delays) {
+    pthread_mutex_lock(&delays->lock);
+    uint64_t due = delays->size > 0 ? delays->heap[0]->due : 0;
+    pthread_mutex_unlock(&delays->lock);
+    return due;
+}
+
+/* Discards the held packets of a socket being closed. */
+static void delay_purge(KTPDelayHeap *delays, int sockfd) {
+    pthread_mutex_lock(&delays->lock);
+    int kept = 0;
+    for (int k = 0; k < delays->size; k++) {
+        if (delays->heap[k]->sockfd == sockfd) {
+            free(delays->heap[k]);
+        } else {
+            delays->heap[kept++] = delays->heap[k];
+        }
+    }
+    delays->size = kept;
+    for (int k = kept / 2 - 1; k >= 0; k--) {
+        delay_sift(delays, k);
+    }
+    pthread_mutex_unlock(&delays->lock);
+}
+
+/* Each socket draws from its own xorshift64* sequence, seeded through
+ * splitmix64 and only advanced under the socket lock. */
+static void impair_seed(KTPSocket *sock, uint64_t seed) {
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    sock->impair_rng = z ? z : 1;
+    sock->impair_bad = 0;
+}
+
+static double impair_random(KTPSocket *sock) {
+    uint64_t x = sock->impair_rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sock->impair_rng = x;
+    return ((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int impair_delays(const KTPImpairment *impair) {
+    return impair->delay_us > 0 || impair->jitter_us > 0 || impair->rate_bps > 0;
+}
+
+static int impair_enabled(const KTPImpairment *impair) {
+    return impair->loss > 0 || impair->ge_p > 0 || impair->duplicate > 0 || impair_delays(impair);
+}
+
+/* Advances the Gilbert-Elliott chain, then decides whether this packet is
+ * lost. */
+static int impair_lost(KTPSocket *sock) {
+    KTPImpairment *impair = &sock->impair;
+    int lost = impair->loss > 0 && impair_random(sock) < impair->loss;
+    if (impair->ge_p > 0) {
+        if (sock->impair_bad ? impair_random(sock) < impair->ge_r : impair_random(sock) < impair->ge_p) {
+            sock->impair_bad = !sock->impair_bad;
+        }
+        float ge_loss = sock->impair_bad ? impair->ge_loss_bad : impair->ge_loss_good;
+        lost |= ge_loss > 0 && impair_random(sock) < ge_loss;
+    }
+    return lost;
+}
+
+/* Works out when a packet of len bytes queued at now may leave: after the
+ * rate cap's link is free, then after the delay and jitter unless the
+ * packet is picked for reordering. */
+static uint64_t impair_due(KTPSocket *sock, size_t len, uint64_t now) {
+    KTPImpairment *impair = &sock->impair;
+    uint64_t due = now;
+    if (impair->rate_bps > 0) {
+        if (sock->impair_link_free < now) {
+            sock->impair_link_free = now;
+        }
+        sock->impair_link_free += len * 8 * 1000000000ULL / impair->rate_bps;
+        due = sock->impair_link_free;
+    }
+    if (impair->reorder > 0 && impair_random(sock) < impair->reorder) {
+        return due;
+    }
+    int64_t delay = (int64_t)impair->delay_us * 1000;
+    if (impair->jitter_us > 0) {
+        delay += (int64_t)((2 * impair_random(sock) - 1) * impair->jitter_us * 1000);
+    }
+    return delay > 0 ? due + delay : due;
+}
+
+/* Sends the held packets that are due. A packet whose socket was closed or
+ * reopened meanwhile is discarded. The packet is a private copy, so only
+ * the check needs the socket lock. */
+static void impair_release(KTPDelayHeap *delays, uint64_t now) {
+    KTPDelayed *packet;
+    while ((packet = delay_pop(delays, now)) != NULL) {
+        KTPSocket *sock = ktp_socket(packet->sockfd);
+        pthread_mutex_lock(&sock->lock);
+        int live = !sock->is_free && sock->udp_socket == packet->udp_socket;
+        if (live) {
+            sock->impair_queued--;
+        }
+        pthread_mutex_unlock(&sock->lock);
+        if (live && sendto(packet->udp_socket, packet->data, packet->len, 0,
+                           (struct sockaddr *)&packet->addr, sizeof(packet->addr)) < 0) {
+            perror("sendto");
+        }
+        free(packet);
+    }
+}
+
+int k_impair_parse(const char *spec, KTPImpairment *impair) {
+    KTPImpairment parsed = *impair;
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        return -1;
+    }
+    int ok = 1;
+    char *saveptr;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok != NULL && ok; tok = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(tok, '=');
+        if (value == NULL) {
+            ok = 0;
+            break;
+        }
+        *value++ = '\0';
+        char *end;
+        errno = 0;
+        double number = strtod(value, &end);
+        ok = *value != '\0' && *end == '\0' && errno == 0 && number >= 0;
+        if (!strcmp(tok, "loss")) parsed.loss = number;
+        else if (!strcmp(tok, "ge_p")) parsed.ge_p = number;
+        else if (!strcmp(tok, "ge_r")) parsed.ge_r = number;
+        else if (!strcmp(tok, "ge_loss_good")) parsed.ge_loss_good = number;
+        else if (!strcmp(tok, "ge_loss_bad")) parsed.ge_loss_bad = number;
+        else if (!strcmp(tok, "delay_us")) parsed.delay_us = number;
+        else if (!strcmp(tok, "jitter_us")) parsed.jitter_us = number;
+        else if (!strcmp(tok, "reorder")) parsed.reorder = number;
+        else if (!strcmp(tok, "duplicate")) parsed.duplicate = number;
+        else if (!strcmp(tok, "rate_bps")) parsed.rate_bps = number;
+        else if (!strcmp(tok, "limit")) parsed.limit = number;
+        else if (!strcmp(tok, "seed")) parsed.seed = strtoull(value, NULL, 0);
+        else ok = 0;
+    }
+    free(copy);
+    if (!ok) {
+        errno = EINVAL;
+        return -1;
+    }
+    *impair = parsed;
+    return 0;
+}
+
+/* Each packet is a header iovec plus a payload iovec pointing straight at the
+ * send slot (or at sack for ACKs), so no packet is assembled in memory.
+ * pinned lists the send slots the batch reads from. */
+typedef struct {
+    struct mmsghdr msgs[KTP_BATCH];
+    struct iovec iovs[KTP_BATCH][2];
+    KTPHeader headers[KTP_BATCH];
+    KTPSendSlot *pinned[KTP_BATCH];
+    int npinned;
+    unsigned char sack[MESSAGE_SIZE];
+    char parity[KTP_BATCH / 2][MESSAGE_SIZE];
+    int parities;
+    struct mmsghdr impaired[2 * KTP_BATCH];
+    struct mmsghdr gso[2 * KTP_BATCH];
+    struct iovec gso_iovs[4 * KTP_BATCH];
+    int gso_first[2 * KTP_BATCH];
+    struct sockaddr_in addr;
+    int sockfd;
+    int udp_socket;
+    int count;
+} KTPBatch;
+
+static void header_to_wire(KTPHeader *wire, const KTPHeader *header) {
+    *wire = *header;
+    wire->seq_num = htonl(header->seq_num);
+    wire->cum_ack = htonl(header->cum_ack);
+    wire->rwnd_size = htonl(header->rwnd_size);
+    wire->ack_seq = htonl(header->ack_seq);
+    wire->payload_len = htons(header->payload_len);
+}
+
+static void header_from_wire(KTPHeader *header) {
+    header->seq_num = ntohl(header->seq_num);
+    header->cum_ack = ntohl(header->cum_ack);
+    header->rwnd_size = ntohl(header->rwnd_size);
+    header->ack_seq = ntohl(header->ack_seq);
+    header->payload_len = ntohs(header->payload_len);
+}
+
+/* Runs the batch through the socket's impairments: lost packets are left
+ * out, packets that must wait are copied to the delay heap, and the rest
+ * (duplicates twice) go to batch->impaired. Returns how many are there. */
+static int batch_impair(KTPBatch *batch) {
+    KTPSocket *sock = ktp_socket(batch->sockfd);
+    int delays = impair_delays(&sock->impair);
+    uint64_t now = delays ? monotonic_ns() : 0;
+    int out = 0;
+    for (int k = 0; k < batch->count; k++) {
+        KTPHeader *header = &batch->headers[k];
+        uint32_t seq = ntohl(header->flags & KTP_FLAG_DATA ? header->seq_num : header->cum_ack);
+        if (impair_lost(sock)) {
+            STAT_ADD(sock, drops, 1);
+            TRACE(KTP_TRACE_LOSS, batch->sockfd, KTP_EV_DROP, seq, sock->impair_queued);
+            continue;
+        }
+        int copies = sock->impair.duplicate > 0 && impair_random(sock) < sock->impair.duplicate ? 2 : 1;
+        for (int c = 0; c < copies; c++) {
+            if (!delays) {
+                batch->impaired[out++] = batch->msgs[k];
+                continue;
+            }
+            if (sock->impair_queued >= (int)sock->impair.limit) {
+                STAT_ADD(sock, drops, 1);
+                TRACE(KTP_TRACE_LOSS, batch->sockfd, KTP_EV_QUEUE_FULL, seq, sock->impair_queued);
+                continue;
+            }
+            KTPDelayed *packet = malloc(sizeof(KTPDelayed));
+            if (packet == NULL) {
+                perror("malloc");
+                continue;
+            }
+            packet->sockfd = batch->sockfd;
+            packet->udp_socket = batch->udp_socket;
+            packet->addr = batch->addr;
+            packet->len = 0;
+            struct msghdr *msg = &batch->msgs[k].msg_hdr;
+            for (size_t v = 0; v < msg->msg_iovlen; v++) {
+                memcpy(packet->data + packet->len, msg->msg_iov[v].iov_base, msg->msg_iov[v].iov_len);
+                packet->len += msg->msg_iov[v].iov_len;
+            }
+            packet->due = impair_due(sock, packet->len, now);
+            sock->impair_queued++;
+            delay_push(&delay_heaps[sock->worker], packet);
+        }
+    }
+    return out;
+}
+
+static size_t message_length(const struct msghdr *msg) {
+    size_t len = 0;
+    for (size_t v = 0; v < msg->msg_iovlen; v++) {
+        len += msg->msg_iov[v].iov_len;
+    }
+    return len;
+}
+
+/* For sockets with UDP_SEGMENT set, merges each run of full-size packets,
+ * plus the shorter one that may end it, into one super-buffer that the
+ * kernel cuts back into packets: one traversal of the UDP stack per run
+ * instead of per packet. The payload iovecs still point at the send slots.
+ * gso_first records where each merged message starts in msgs. */
+static int batch_coalesce(KTPBatch *batch, struct mmsghdr *msgs, int count) {
+    const size_t full = sizeof(KTPHeader) + MESSAGE_SIZE;
+    int out = 0, iovs = 0;
+    for (int k = 0; k < count;) {
+        struct mmsghdr *gso = &batch->gso[out];
+        batch->gso_first[out++] = k;
+        *gso = msgs[k];
+        gso->msg_hdr.msg_iov = &batch->gso_iovs[iovs];
+        gso->msg_hdr.msg_iovlen = 0;
+        int segments = 0;
+        size_t len;
+        do {
+            struct msghdr *msg = &msgs[k++].msg_hdr;
+            memcpy(&batch->gso_iovs[iovs], msg->msg_iov, msg->msg_iovlen * sizeof(struct iovec));
+            iovs += msg->msg_iovlen;
+            gso->msg_hdr.msg_iovlen += msg->msg_iovlen;
+            len = message_length(msg);
+        } while (len == full && ++segments < KTP_GSO_SEGMENTS && k < count);
+    }
+    return out;
+}
+
+/* A worker's io_uring, driven with raw syscalls. Every UDP socket of the
+ * shard has a multishot recvmsg posted that takes buffers from the
+ * worker's provided buffer ring, and so does the doorbell. Sends are queued
+ * as sendmsg requests during a round, their packets copied into arena,
+ * and go to the kernel with the round's single io_uring_enter(), which
+ * also waits for completions. */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+    unsigned queued;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    uint16_t buf_tail;
+    struct msghdr recv_msg;
+    int doorbell;
+    int doorbell_armed;
+    struct {
+        struct msghdr msg;
+        struct iovec iov;
+        struct sockaddr_in addr;
+        int sockfd;
+        int udp_socket;
+    } *sends;
+    int nsends;
+    int inflight;
+    size_t arena_used;
+    char *arena;
+} KTPUring;
+
+#define URING_RECV 1
+#define URING_DOORBELL 2
+#define URING_SEND 3
+#define URING_DATA(type, gen, id) \
+    ((uint64_t)(type) << 56 | (uint64_t)((gen) & 0xffffff) << 32 | (uint32_t)(id))
+#define URING_BUFFER_SIZE \
+    (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + sizeof(KTPHeader) + MESSAGE_SIZE)
+
+/* The calling worker's ring, NULL with the epoll backend. */
+static __thread KTPUring *current_uring = NULL;
+
+/* Submits the queued requests and, with min_complete, waits for that many
+ * completions or timeout_ns (0 = none). */
+static void uring_submit(KTPUring *u, unsigned min_complete, uint64_t timeout_ns) {
+    struct __kernel_timespec ts = {timeout_ns / 1000000000ULL, timeout_ns % 1000000000ULL};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    if (min_complete > 0 && timeout_ns > 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int n = syscall(__NR_io_uring_enter, u->fd, u->queued, min_complete, flags,
+                    (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+    if (n >= 0) {
+        u->queued -= n;
+    } else if (errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        perror("io_uring_enter");
+    }
+}
+
+/* Returns a cleared submission entry, or NULL if the queue stays full. */
+static struct io_uring_sqe *uring_sqe(KTPUring *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+        uring_submit(u, 0, 0);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+/* Queues msgs as sendmsg requests, each packet copied into the arena as
+ * the send slots may change before the round's submit. Returns how many
+ * were queued; the arena fills up only once a round sends more than
+ * KTP_URING_ARENA bytes. */
+static int uring_send(KTPUring *u, int sockfd, int udp_socket, struct mmsghdr *msgs, int count) {
+    int queued = 0;
+    for (; queued < count && u->nsends < KTP_URING_ENTRIES; queued++) {
+        struct msghdr *msg = &msgs[queued].msg_hdr;
+        size_t len = 0;
+        for (size_t v = 0; v < msg->msg_iovlen; v++) {
+            len += msg->msg_iov[v].iov_len;
+        }
+        if (u->arena_used + len > KTP_URING_ARENA) {
+            break;
+        }
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        if (sqe == NULL) {
+            break;
+        }
+        int n = u->nsends++;
+        char *data = u->arena + u->arena_used;
+        for (size_t v = 0, off = 0; v < msg->msg_iovlen; off += msg->msg_iov[v++].iov_len) {
+            memcpy(data + off, msg->msg_iov[v].iov_base, msg->msg_iov[v].iov_len);
+        }
+        u->arena_used += (len + 15) & ~(size_t)15;
+        memset(&u->sends[n].msg, 0, sizeof(struct msghdr));
+        memcpy(&u->sends[n].addr, msg->msg_name, sizeof(struct sockaddr_in));
+        u->sends[n].msg.msg_name = &u->sends[n].addr;
+        u->sends[n].msg.msg_namelen = sizeof(struct sockaddr_in);
+        u->sends[n].iov.iov_base = data;
+        u->sends[n].iov.iov_len = len;
+        u->sends[n].msg.msg_iov = &u->sends[n].iov;
+        u->sends[n].msg.msg_iovlen = 1;
+        u->sends[n].sockfd = sockfd;
+        u->sends[n].udp_socket = udp_socket;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = udp_socket;
+        sqe->addr = (uint64_t)(uintptr_t)&u->sends[n].msg;
+        sqe->len = 1;
+        sqe->user_data = URING_DATA(URING_SEND, 0, n);
+        u->inflight++;
+    }
+    return queued;
+}
+
+/* Sends msgs on the socket. With the io_uring backend they are only
+ * queued, and a failure shows up when the send completes. */
+static int send_all(int sockfd, int udp_socket, struct mmsghdr *msgs, int count) {
+    int sent = 0;
+    if (current_uring != NULL) {
+        sent = uring_send(current_uring, sockfd, udp_socket, msgs, count);
+        if (sent < count) {
+            /* Out of room: what was queued goes first, the rest directly. */
+            uring_submit(current_uring, 0, 0);
+        }
+    }
+    while (sent < count) {
+        int n = sendmmsg(udp_socket, msgs + sent, count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+/* Drops a pin taken while the socket lock was released for a syscall.
+ * Returns 1 when the last one went and someone is waiting for that; the
+ * caller then broadcasts send_cond once it has unlocked. Caller holds the
+ * socket lock. */
+static int unpin_socket(KTPSocket *sock) {
+    if (--sock->pins > 0 || !sock->pin_wait) {
+        return 0;
+    }
+    sock->pin_wait = 0;
+    return 1;
+}
+
+/* Waits until no syscall has the socket pinned. Caller holds the socket
+ * lock. */
+static void wait_unpinned(KTPSocket *sock) {
+    while (sock->pins > 0) {
+        sock->pin_wait = 1;
+        pthread_cond_wait(&sock->send_cond, &sock->lock);
+    }
+}
+
+/* Sends the batch with sendmmsg, or queues it on the worker's io_uring.
+ * Called with the socket lock held; returns with it released. Payloads are
+ * read straight from the send slots, so those are pinned for the syscalls,
+ * which run without the lock. */
+void batch_flush(KTPBatch *batch) {
+    KTPSocket *sock = ktp_socket(batch->sockfd);
+    struct mmsghdr *msgs = batch->msgs;
+    int count = batch->count;
+    if (count > 0 && impair_enabled(&sock->impair)) {
+        msgs = batch->impaired;
+        count = batch_impair(batch);
+    }
+    int gso = count > 1 && (sock->offload & KTP_OFFLOAD_GSO);
+    batch->count = 0;
+    batch->parities = 0;
+    if (count == 0) {
+        batch->npinned = 0;
+        pthread_mutex_unlock(&sock->lock);
+        return;
+    }
+    for (int k = 0; k < batch->npinned; k++) {
+        batch->pinned[k]->pinned = 1;
+    }
+    sock->pins++;
+    pthread_mutex_unlock(&sock->lock);
+
+    int sent = 0, gso_failed = 0;
+    if (gso) {
+        int merged = batch_coalesce(batch, msgs, count);
+        int n = send_all(batch->sockfd, batch->udp_socket, batch->gso, merged);
+        sent = n < merged ? batch->gso_first[n] : count;
+        /* A device without checksum offload rejects super-buffers with EIO;
+         * the socket then goes back to one datagram per packet. */
+        if (n < merged && errno == EIO) {
+            int zero = 0;
+            setsockopt(batch->udp_socket, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+            gso_failed = 1;
+        }
+    }
+    if (sent < count && send_all(batch->sockfd, batch->udp_socket, msgs + sent, count - sent) < count - sent) {
+        perror("sendmmsg");
+    }
+
+    pthread_mutex_lock(&sock->lock);
+    if (gso_failed) {
+        sock->offload &= ~KTP_OFFLOAD_GSO;
+    }
+    for (int k = 0; k < batch->npinned; k++) {
+        batch->pinned[k]->pinned = 0;
+    }
+    batch->npinned = 0;
+    int unpinned = unpin_socket(sock);
+    pthread_mutex_unlock(&sock->lock);
+    if (unpinned) {
+        pthread_cond_broadcast(&sock->send_cond);
+    }
+}
+
+/* Adds a packet to the batch without copying its payload, its header in
+ * wire order; returns 0 when the batch is already full. */
+int batch_add(KTPBatch *batch, const KTPHeader *header, const void *payload, size_t len) {
+    if (batch->count == KTP_BATCH) {
+        return 0;
+    }
+    int n = batch->count++;
+    header_to_wire(&batch->headers[n], header);
+    batch->iovs[n][0].iov_base = &batch->headers[n];
+    batch->iovs[n][0].iov_len = sizeof(KTPHeader);
+    batch->iovs[n][1].iov_base = (void *)payload;
+    batch->iovs[n][1].iov_len = len;
+    memset(&batch->msgs[n], 0, sizeof(struct mmsghdr));
+    batch->msgs[n].msg_hdr.msg_name = &batch->addr;
+    batch->msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->msgs[n].msg_hdr.msg_iov = batch->iovs[n];
+    batch->msgs[n].msg_hdr.msg_iovlen = len > 0 ? 2 : 1;
+    return 1;
+}
+
+/* Records that the peer is owed an ACK; the socket's worker sends it with the
+ * socket's next batch, on its own or riding on data. Unless immediate, an
+ * in-order arrival is held back until delack.packets have arrived or
+ * delack.timeout_us has passed. Out-of-order and duplicate arrivals and a
+ * full buffer are acknowledged at once, each with its own ACK so the peer
+ * still sees its duplicate ACKs. Caller holds the socket lock; only the
+ * engine may hold an ACK back, as that arms the socket's timer. */
+void queue_ack(int i, uint32_t seq_num, int nospace, int immediate) {
+    KTPSocket *sock = ktp_socket(i);
+    sock->ack_seq = seq_num;
+    sock->ack_nospace = nospace;
+    if (sock->rwnd.max_seq == sock->rwnd.next_seq && !nospace) {
+        if (!immediate && ++sock->ack_held < sock->delack.packets) {
+            if (sock->ack_deadline == 0) {
+                sock->ack_deadline = monotonic_ns() + sock->delack.timeout_us * 1000ULL;
+                timer_schedule_before(i, sock->ack_deadline);
+            }
+            return;
+        }
+        if (sock->ack_pending == 0) {
+            sock->ack_pending = 1;
+        }
+    } else if (sock->ack_pending <= DUPACK_THRESHOLD) {
+        sock->ack_pending++;
+    }
+    sock->ack_held = 0;
+    sock->ack_deadline = 0;
+}
+
+/* An owed ACK can ride on outgoing data unless it has to carry a SACK
+ * bitmap, report a full buffer or be one of several duplicates. */
+static int ack_can_ride(KTPSocket *sock) {
+    return (sock->ack_pending == 1 || (sock->ack_pending == 0 && sock->ack_held > 0)) &&
+           !sock->ack_nospace && sock->rwnd.max_seq == sock->rwnd.next_seq;
+}
+
+static void fill_ack(KTPSocket *sock, KTPHeader *header) {
+    header->flags |= KTP_FLAG_ACK;
+    header->cum_ack = sock->rwnd.next_seq;
+    header->rwnd_size = sock->rcv_wnd - sock->recv_buffer_size;
+    header->ack_seq = sock->ack_seq;
+    header->is_nospace = sock->ack_nospace;
+}
+
+void batch_add_acks(KTPBatch *batch, int i) {
+    KTPSocket *sock = ktp_socket(i);
+    unsigned char *sack = batch->sack;
+    uint32_t sack_bits = sock->rwnd.max_seq - sock->rwnd.next_seq;
+    KTPHeader header = {
+        .payload_len = (sack_bits + 7) / 8
+    };
+    fill_ack(sock, &header);
+
+    memset(sack, 0, header.payload_len);
+    for (uint32_t k = 1; k < sack_bits; k++) {
+        if (received_bit(i, sock->rwnd.next_seq + k)) {
+            sack[k / 8] |= 1 << (k % 8);
+        }
+    }
+    for (; sock->ack_pending > 0; sock->ack_pending--) {
+        if (!batch_add(batch, &header, sack, header.payload_len)) {
+            break;
+        }
+        STAT_ADD(sock, acks_sent, 1);
+        if (header.is_nospace) {
+            STAT_ADD(sock, nospace_sent, 1);
+        }
+    }
+}
+
+/* Adds a data packet from send slot `slot`, with the socket's owed ACK
+ * riding on it if it can. */
+int batch_add_slot(KTPBatch *batch, int i, int slot) {
+    KTPSocket *sock = ktp_socket(i);
+    KTPSendSlot *send_slot = &send_slots(i)[slot];
+    KTPHeader header = {
+        .seq_num = send_slot->seq_num,
+        .payload_len = send_slot->length,
+        .flags = KTP_FLAG_DATA
+    };
+    int ride = ack_can_ride(sock);
+    if (ride) {
+        fill_ack(sock, &header);
+    }
+    if (!batch_add(batch, &header, send_slot->data, send_slot->length)) {
+        return 0;
+    }
+    batch->pinned[batch->npinned++] = send_slot;
+    if (ride) {
+        sock->ack_pending = 0;
+        sock->ack_held = 0;
+        sock->ack_deadline = 0;
+        STAT_ADD(sock, acks_piggybacked, 1);
+    }
+    STAT_ADD(sock, packets_sent, 1);
+    STAT_ADD(sock, bytes_sent, send_slot->length);
+    return 1;
+}
+
+/* dst ^= src, a word at a time. */
+static void xor_bytes(char *dst, const char *src, int len) {
+    int b = 0;
+    for (; b + 8 <= len; b += 8) {
+        uint64_t x, y;
+        memcpy(&x, dst + b, 8);
+        memcpy(&y, src + b, 8);
+        x ^= y;
+        memcpy(dst + b, &x, 8);
+    }
+    for (; b < len; b++) {
+        dst[b] ^= src[b];
+    }
+}
+
+static KTPFec *fec_state(int i) {
+    if (FEC_STATE(i) == NULL && (FEC_STATE(i) = calloc(1, sizeof(KTPFec))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return FEC_STATE(i);
+}
+
+/* Drops a partly built parity block. */
+static void fec_discard(KTPFec *fec) {
+    memset(fec->block.data, 0, fec->block.length);
+    fec->block.count = 0;
+    fec->block.length_xor = 0;
+    fec->block.length = 0;
+}
+
+/* Folds a newly sent message into the socket's parity block and, once the
+ * block holds k messages, adds the block's parity packet to the batch; the
+ * caller leaves room for it. With KTP_FEC_AUTO, k starts at 4 and is
+ * revised every KTP_FEC_EPOCH packets: halved while more than 1% of them
+ * are retransmissions, doubled while fewer than 0.25% are. */
+static void fec_send(KTPBatch *batch, int i, const KTPSendSlot *slot) {
+    KTPSocket *sock = ktp_socket(i);
+    KTPFec *fec = fec_state(i);
+    /* A block covers consecutive sequence numbers under one setting; one
+     * left over from before KTP_FEC changed would describe messages it
+     * does not hold. */
+    if (fec->block.count > 0 &&
+        (sock->fec != fec->setting || slot->seq_num != fec->block.first + fec->block.count)) {
+        fec_discard(fec);
+    }
+    fec->setting = sock->fec;
+    if (sock->fec != KTP_FEC_AUTO) {
+        fec->k = sock->fec;
+    } else if (fec->k == 0) {
+        fec->k = 4;
+    } else if (sock->stats.packets_sent - fec->epoch_packets >= KTP_FEC_EPOCH) {
+        uint64_t packets = sock->stats.packets_sent - fec->epoch_packets;
+        uint64_t retransmits = sock->stats.retransmits - fec->epoch_retransmits;
+        if (retransmits * 100 > packets && fec->k > 2) {
+            fec->k /= 2;
+        } else if (retransmits * 400 < packets && fec->k < KTP_FEC_MAX_K) {
+            fec->k *= 2;
+        }
+        fec->epoch_packets = sock->stats.packets_sent;
+        fec->epoch_retransmits = sock->stats.retransmits;
+    }
+
+    if (fec->block.count == 0) {
+        fec->block.first = slot->seq_num;
+    }
+    xor_bytes(fec->block.data, slot->data, slot->length);
+    fec->block.length_xor ^= slot->length;
+    if (slot->length > fec->block.length) {
+        fec->block.length = slot->length;
+    }
+    if (++fec->block.count < fec->k) {
+        return;
+    }
+
+    char *payload = batch->parity[batch->parities++];
+    memcpy(payload, fec->block.data, fec->block.length);
+    KTPHeader header = {
+        .seq_num = fec->block.first,
+        .rwnd_size = fec->block.count,
+        .ack_seq = fec->block.length_xor,
+        .payload_len = fec->block.length,
+        .flags = KTP_FLAG_PARITY
+    };
+    batch_add(batch, &header, payload, header.payload_len);
+    STAT_ADD(sock, parity_sent, 1);
+    TRACE(KTP_TRACE_ALL, i, KTP_EV_PARITY, fec->block.first, fec->block.count);
+    fec_discard(fec);
+}
+
+/* Marks in-flight packet j (counted from the window head) acknowledged and
+ * takes an RTT sample if it is the packet this ACK echoes. */
+static int ack_in_flight(int i, int j, uint32_t echo_seq, uint64_t *rtt) {
+    KTPSocket *sock = ktp_socket(i);
+    KTPSendSlot *slot = &send_slots(i)[SEND_SLOT(sock, j)];
+    if (slot->acked) {
+        return 0;
+    }
+    slot->acked = 1;
+    if (slot->seq_num == echo_seq && !slot->retransmitted) {
+        *rtt = monotonic_ns() - slot->send_time;
+        rtt_sample(sock, *rtt);
+    }
+    return 1;
+}
+
+/* Retires every in-flight packet covered by the cumulative ACK point or the
+ * SACK bitmap and counts duplicate cumulative ACKs. Only set SACK bits are
+ * visited, so the cost follows the number of packets acknowledged rather
+ * than the window size. Caller holds the socket lock. */
+void process_ack(int i, KTPHeader *header, const unsigned char *sack) {
+    KTPSocket *sock = ktp_socket(i);
+    uint32_t base_seq = sock->next_seq_num - sock->swnd.size;
+    uint32_t cum_offset = header->cum_ack - base_seq;
+    /* Only a pure ACK carries a SACK bitmap or counts as a duplicate; one
+     * riding on data repeats cum_ack whenever the peer sends. */
+    int pure = !(header->flags & KTP_FLAG_DATA);
+    int sack_len = pure ? header->payload_len : 0;
+    int newly_acked = 0;
+    uint64_t rtt = 0;
+
+    if (cum_offset > (uint32_t)sock->swnd.size) {
+        TRACE(KTP_TRACE_LOSS, i, KTP_EV_UNKNOWN_ACK, header->cum_ack, sock->swnd.size);
+        return;
+    }
+
+    for (uint32_t j = 0; j < cum_offset; j++) {
+        newly_acked += ack_in_flight(i, j, header->ack_seq, &rtt);
+    }
+    for (int byte = 0; byte < sack_len; byte++) {
+        for (int bit = 0; sack[byte] >> bit; bit++) {
+            uint32_t j = cum_offset + byte * 8 + bit;
+            if ((sack[byte] >> bit) & 1 && j < (uint32_t)sock->swnd.size) {
+                newly_acked += ack_in_flight(i, j, header->ack_seq, &rtt);
+            }
+        }
+    }
+
+    KTPSendSlot *slots = send_slots(i);
+    while (sock->swnd.size > 0 && slots[sock->swnd.head].acked) {
+        sock->swnd.head = SEND_SLOT(sock, 1);
+        sock->swnd.size--;
+    }
+
+    if (header->cum_ack != sock->swnd.cum_ack) {
+        sock->swnd.cum_ack = header->cum_ack;
+        sock->swnd.dup_acks = 0;
+        if (sock->cc.in_recovery) {
+            if (SEQ_GEQ(header->cum_ack, sock->cc.recover)) {
+                sock->cc.in_recovery = 0;
+            } else if (sock->swnd.size > 0) {
+                /* NewReno partial ACK: the next hole was lost as well. */
+                sock->swnd.fast_retransmit = 1;
+            }
+        }
+    } else if (pure && sock->swnd.size > 0 && !header->is_nospace &&
+               ++sock->swnd.dup_acks == DUPACK_THRESHOLD) {
+        sock->swnd.fast_retransmit = 1;
+        cc_on_loss(sock);
+        TRACE(KTP_TRACE_LOSS, i, KTP_EV_DUPACKS, header->cum_ack, sock->cc.cwnd);
+    }
+    if (newly_acked) {
+        cc_on_ack(sock, newly_acked, rtt);
+    }
+
+    /* A held ACK keeps the timer armed for its deadline. */
+    if (sock->swnd.size == 0 && sock->ack_deadline == 0) {
+        timer_cancel(i);
+    }
+    if (newly_acked) {
+        TRACE(KTP_TRACE_ALL, i, KTP_EV_ACK, header->cum_ack, sock->swnd.size);
+    }
+}
+
+/* Accepts a data packet unless it lies outside the advertised window (the
+ * rcv_wnd - recv_buffer_size sequence numbers from next_seq) or the
+ * received-sequence bitmap shows it already arrived. The payload normally
+ * already sits in receive slot `slot`; a payload that landed in the
+ * receiver's scratch buffer (slot -1) is copied into a free slot. The slot
+ * is parked in the reorder map until every earlier message has arrived, and
+ * then moved to the receive ring with the rest of the in-order run, so
+ * messages are delivered strictly in sequence. Since the window's right edge
+ * never moves back, an accepted packet always finds a free slot. Returns 1
+ * if accepted. */
+int accept_data(int i, uint32_t seq_num, const char *payload, size_t len, int slot) {
+    KTPSocket *sock = ktp_socket(i);
+    uint32_t offset = seq_num - sock->rwnd.next_seq;
+
+    if (offset >= (uint32_t)(sock->rcv_wnd - sock->recv_buffer_size) || received_bit(i, seq_num)) {
+        return 0;
+    }
+
+    if (slot < 0) {
+        slot = free_slot_pop(i);
+        memcpy(recv_slots(i)[slot].data, payload, len);
+    }
+    recv_slots(i)[slot].seq_num = seq_num;
+    recv_slots(i)[slot].length = len;
+    recv_reorder(i)[seq_num % sock->rcv_wnd] = slot;
+    sock->last_ack_seq = seq_num;
+
+    set_received_bit(i, seq_num, 1);
+    if (SEQ_GEQ(seq_num, sock->rwnd.max_seq)) {
+        sock->rwnd.max_seq = seq_num + 1;
+    }
+    KTPFec *fec = FEC_STATE(i);
+    while (received_bit(i, sock->rwnd.next_seq) && sock->rwnd.next_seq != sock->rwnd.max_seq) {
+        uint16_t delivered = recv_reorder(i)[sock->rwnd.next_seq % sock->rcv_wnd];
+        if (fec != NULL && fec->recording) {
+            KTPRecvSlot *copy = &recv_slots(i)[delivered];
+            int h = sock->rwnd.next_seq % KTP_FEC_MAX_K;
+            fec->history[h].seq_num = sock->rwnd.next_seq;
+            fec->history[h].valid = 1;
+            fec->history[h].length = copy->length;
+            memcpy(fec->history[h].data, copy->data, copy->length);
+        }
+        recv_ring(i)[RECV_SLOT(sock, sock->recv_buffer_size)] = delivered;
+        sock->recv_buffer_size++;
+        set_received_bit(i, sock->rwnd.next_seq, 0);
+        sock->rwnd.next_seq++;
+    }
+    return 1;
+}
+
+/* Rebuilds the one missing message of the block of held parity p from the
+ * parity and the rest of the block. Returns 0 while more of the block is
+ * missing, so the parity is worth keeping, and 1 once it is of no further
+ * use: the message was rebuilt, none was missing, or part of the block is
+ * no longer at hand. Caller holds the socket lock. */
+static int fec_recover(int i, KTPFec *fec, int p) {
+    KTPSocket *sock = ktp_socket(i);
+    KTPParityBlock *parity = &fec->pending[p];
+    uint32_t missing = 0;
+    int gaps = 0;
+    for (uint32_t seq = parity->first; seq != parity->first + parity->count; seq++) {
+        if (SEQ_LT(seq, sock->rwnd.next_seq)) {
+            continue;
+        }
+        if (seq - sock->rwnd.next_seq >= (uint32_t)sock->rcv_wnd) {
+            return 1;
+        }
+        if (!received_bit(i, seq)) {
+            missing = seq;
+            gaps++;
+        }
+    }
+    if (gaps != 1) {
+        return gaps == 0;
+    }
+    if (sock->recv_free_count == 0) {
+        return 0;
+    }
+
+    char data[MESSAGE_SIZE];
+    uint16_t length = parity->length_xor;
+    memcpy(data, parity->data, parity->length);
+    for (uint32_t seq = parity->first; seq != parity->first + parity->count; seq++) {
+        const char *payload;
+        uint16_t len;
+        if (seq == missing) {
+            continue;
+        } else if (SEQ_LT(seq, sock->rwnd.next_seq)) {
+            int h = seq % KTP_FEC_MAX_K;
+            if (!fec->history[h].valid || fec->history[h].seq_num != seq) {
+                return 1;
+            }
+            payload = fec->history[h].data;
+            len = fec->history[h].length;
+        } else {
+            KTPRecvSlot *slot = &recv_slots(i)[recv_reorder(i)[seq % sock->rcv_wnd]];
+            payload = slot->data;
+            len = slot->length;
+        }
+        if (len > parity->length) {
+            return 1;
+        }
+        xor_bytes(data, payload, len);
+        length ^= len;
+    }
+    if (length > parity->length) {
+        return 1;
+    }
+
+    accept_data(i, missing, data, length, -1);
+    STAT_ADD(sock, fec_recovered, 1);
+    TRACE(KTP_TRACE_LOSS, i, KTP_EV_FEC_RECOVER, missing, sock->recv_buffer_size);
+    sock->nospace_flag = (sock->rcv_wnd - sock->recv_buffer_size == 0);
+    queue_ack(i, missing, 0, 1);
+    return 1;
+}
+
+/* Holds a parity packet, replacing the oldest held one if need be, and
+ * tries to use it at once. The first parity a socket receives starts the
+ * copying of delivered messages. */
+static void fec_receive(int i, const KTPHeader *header, const char *payload) {
+    KTPSocket *sock = ktp_socket(i);
+    if (header->rwnd_size < 2 || header->rwnd_size > KTP_FEC_MAX_K || header->payload_len > MESSAGE_SIZE) {
+        TRACE(KTP_TRACE_LOSS, i, KTP_EV_MALFORMED, header->seq_num, header->payload_len);
+        STAT_ADD(sock, drops, 1);
+        return;
+    }
+
+    KTPFec *fec = fec_state(i);
+    fec->recording = 1;
+    int p = fec->next_pending;
+    fec->next_pending = (p + 1) % KTP_FEC_PENDING;
+    fec->pending[p].first = header->seq_num;
+    fec->pending[p].count = header->rwnd_size;
+    fec->pending[p].length_xor = header->ack_seq;
+    fec->pending[p].length = header->payload_len;
+    memcpy(fec->pending[p].data, payload, header->payload_len);
+    if (fec_recover(i, fec, p)) {
+        fec->pending[p].count = 0;
+    }
+}
+
+/* Retries the held parity after a data packet was accepted. */
+static void fec_retry(int i) {
+    KTPFec *fec = FEC_STATE(i);
+    if (fec == NULL) {
+        return;
+    }
+    for (int p = 0; p < KTP_FEC_PENDING; p++) {
+        if (fec->pending[p].count > 0 && fec_recover(i, fec, p)) {
+            fec->pending[p].count = 0;
+        }
+    }
+}
+
+/* Handles one datagram whose payload was read into receive slot `slot`, or
+ * into scratch memory when slot is -1; header is still in wire order.
+ * Returns 1 if the slot now holds a delivered message. Caller holds the
+ * socket lock. */
+int handle_packet(int i, KTPHeader *header, char *payload, ssize_t bytes_received, int slot) {
+    KTPSocket *sock = ktp_socket(i);
+
+    if (bytes_received >= (ssize_t)sizeof(KTPHeader)) {
+        header_from_wire(header);
+    }
+    if (bytes_received < (ssize_t)sizeof(KTPHeader) ||
+        header->payload_len != bytes_received - sizeof(KTPHeader)) {
+        TRACE(KTP_TRACE_LOSS, i, KTP_EV_MALFORMED, 0, bytes_received);
+        STAT_ADD(sock, drops, 1);
+        return 0;
+    }
+    
+    if (header->flags & KTP_FLAG_ACK) {
+        STAT_ADD(sock, acks_received, 1);
+        if (header->is_nospace) {
+            STAT_ADD(sock, nospace_received, 1);
+        }
+        process_ack(i, header, (unsigned char *)payload);
+        /* rwnd_size counts from cum_ack; what is already in flight beyond
+         * it uses part of that window. */
+        uint32_t outstanding = sock->next_seq_num - header->cum_ack;
+        sock->rwnd.size = header->rwnd_size > outstanding ? header->rwnd_size - outstanding : 0;
+        if (!(header->flags & KTP_FLAG_DATA)) {
+            return 0;
+        }
+    }
+
+    if (header->flags & KTP_FLAG_PARITY) {
+        fec_receive(i, header, payload);
+        return 0;
+    }
+
+    uint32_t seq_num = header->seq_num;
+    sock->last_data_time = monotonic_ns();
+    STAT_ADD(sock, packets_received, 1);
+    STAT_ADD(sock, bytes_received, header->payload_len);
+    if (slot < 0 && sock->recv_free_count == 0) {
+        sock->nospace_flag = 1;
+        queue_ack(i, sock->last_ack_seq, 1, 1);
+        TRACE(KTP_TRACE_LOSS, i, KTP_EV_NOSPACE, seq_num, sock->recv_buffer_size);
+        return 0;
+    }
+
+    int in_order = seq_num == sock->rwnd.next_seq && sock->rwnd.max_seq == sock->rwnd.next_seq;
+    int accepted = accept_data(i, seq_num, payload, header->payload_len, slot);
+    if (accepted) {
+        TRACE(KTP_TRACE_ALL, i, KTP_EV_RECV, seq_num, sock->recv_buffer_size);
+        fec_retry(i);
+    } else {
+        STAT_ADD(sock, duplicates, 1);
+        TRACE(KTP_TRACE_LOSS, i, KTP_EV_DUPLICATE, seq_num, sock->recv_buffer_size);
+    }
+    
+    int available_space = sock->rcv_wnd - sock->recv_buffer_size;
+    sock->nospace_flag = (available_space == 0);
+    queue_ack(i, seq_num, 0, !(accepted && in_order));
+    return accepted && slot >= 0;
+}
+
+/* Engine-side state of a worker thread. Each worker owns a shard of the
+ * sockets and runs one event loop for it: its epoll set holds the shard's
+ * UDP sockets, its doorbell and a timerfd for the next timer or held
+ * packet. */
+typedef struct {
+    int epoll_fd;
+    int doorbell;
+    int timer_fd;
+    uint64_t timer_armed;
+    pthread_mutex_t shard_lock;
+    int *shard;
+    int shard_size;
+    int shard_capacity;
+    KTPBatch batch;
+    struct mmsghdr msgs[KTP_BATCH];
+    struct iovec iovs[KTP_BATCH][2];
+    KTPHeader headers[KTP_BATCH];
+    char scratch[KTP_BATCH][MESSAGE_SIZE];
+    int posted[KTP_BATCH];
+    struct sockaddr_in names[KTP_BATCH];
+    /* Allocated on the first read from a socket with UDP_GRO on. */
+    char *gro_buffers;
+    KTPUring *uring;
+} KTPEngineWorker;
+
+/* Engine only. */
+KTPEngineWorker *workers;
+int worker_cpus[KTP_MAX_WORKERS];
+int worker_ncpus = 0;
+
+#define EVENT_DOORBELL UINT32_MAX
+#define EVENT_TIMER (UINT32_MAX - 1)
+
+static void receive_listener(KTPEngineWorker *w, int l);
+static void listener_packet(int l, const struct sockaddr_in *peer, KTPHeader *header, char *payload,
+                            ssize_t len);
+static int engine_close(int sockfd);
+
+static void uring_free(KTPUring *u) {
+    if (u->ring != NULL && u->ring != MAP_FAILED) {
+        munmap(u->ring, u->ring_size);
+    }
+    if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->buf_ring != NULL && u->buf_ring != MAP_FAILED) {
+        munmap(u->buf_ring, KTP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    if (u->fd > 0) {
+        close(u->fd);
+    }
+    free(u->buffers);
+    free(u->sends);
+    free(u->arena);
+}
+
+/* Puts buffer bid back on the buffer ring; the kernel sees it once the
+ * tail is published. */
+static void uring_recycle(KTPUring *u, uint16_t bid) {
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (KTP_URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    u->buf_tail++;
+}
+
+/* Queues a multishot recvmsg on fd whose datagrams land in buffers from the
+ * buffer ring, each laid out as a struct io_uring_recvmsg_out, the
+ * sender's address and the packet. */
+static int uring_recv(KTPUring *u, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/* Sets up a worker's ring, its buffer ring and the doorbell's receive.
+ * Returns -1 if the kernel lacks any of it: multishot recvmsg and
+ * synchronous cancellation need Linux 6.0. */
+static int uring_init(KTPUring *u, int doorbell) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = 4 * KTP_URING_BUFFERS;
+    u->fd = syscall(__NR_io_uring_setup, KTP_URING_ENTRIES, &params);
+    if (u->fd == -1 && errno == EINVAL) {
+        params.flags = IORING_SETUP_CQSIZE;
+        u->fd = syscall(__NR_io_uring_setup, KTP_URING_ENTRIES, &params);
+    }
+    unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if (u->fd == -1 || (params.features & features) != features) {
+        uring_free(u);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQ_RING);
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQES);
+    u->buf_ring = mmap(NULL, KTP_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = malloc((size_t)KTP_URING_BUFFERS * URING_BUFFER_SIZE);
+    u->sends = calloc(KTP_URING_ENTRIES, sizeof(*u->sends));
+    u->arena = malloc(KTP_URING_ARENA);
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED || u->buf_ring == MAP_FAILED ||
+        u->buffers == NULL || u->sends == NULL || u->arena == NULL) {
+        uring_free(u);
+        return -1;
+    }
+    char *ring = u->ring;
+    u->sq_head = (unsigned *)(ring + params.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    u->sq_array = (unsigned *)(ring + params.sq_off.array);
+    u->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->cq_head = (unsigned *)(ring + params.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = KTP_URING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        uring_free(u);
+        return -1;
+    }
+    for (int b = 0; b < KTP_URING_BUFFERS; b++) {
+        uring_recycle(u, b);
+    }
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+    /* Nothing to cancel yet: ENOENT where synchronous cancellation exists. */
+    struct io_uring_sync_cancel_reg cancel;
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.addr = URING_DATA(URING_SEND, 0, 0);
+    cancel.timeout.tv_sec = -1;
+    cancel.timeout.tv_nsec = -1;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1) != -1 ||
+        errno != ENOENT) {
+        uring_free(u);
+        return -1;
+    }
+
+    /* A kernel without multishot recvmsg fails the request at once. */
+    u->doorbell = doorbell;
+    uring_recv(u, doorbell, URING_DATA(URING_DOORBELL, 0, 0));
+    uring_submit(u, 0, 0);
+    unsigned head = *u->cq_head;
+    if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) && u->cqes[head & u->cq_mask].res < 0) {
+        uring_free(u);
+        return -1;
+    }
+    u->doorbell_armed = 1;
+    return 0;
+}
+
+/* Posts socket i's multishot receive. It is submitted at once, under the
+ * socket lock, so that engine_close() always finds it to cancel. */
+static void uring_arm(KTPUring *u, int i) {
+    KTPSocket *sock = ktp_socket(i);
+    pthread_mutex_lock(&sock->lock);
+    /* A listener's connections read through the listener's receive. */
+    if (!sock->is_free && sock->listener != -1) {
+        RECV_ARMED(i) = 1;
+    } else if (!sock->is_free && !RECV_ARMED(i) &&
+        uring_recv(u, sock->udp_socket, URING_DATA(URING_RECV, RECV_GEN(i) + 1, i)) == 0) {
+        RECV_GEN(i)++;
+        RECV_ARMED(i) = 1;
+        uring_submit(u, 0, 0);
+    }
+    pthread_mutex_unlock(&sock->lock);
+}
+
+/* Cancels the receive posted on a socket that is being closed, which
+ * otherwise keeps the UDP socket open. Its port is only released once the
+ * worker has reaped the final completion. */
+static void uring_cancel(KTPUring *u, int udp_socket) {
+    struct io_uring_sync_cancel_reg cancel;
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.fd = udp_socket;
+    cancel.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    cancel.timeout.tv_sec = -1;
+    cancel.timeout.tv_nsec = -1;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1) == -1 &&
+        errno != ENOENT) {
+        perror("io_uring cancel");
+    }
+}
+
+/* Handles a finished send. A device without checksum offload fails GSO
+ * super-buffers with EIO, as in batch_flush(). */
+static void uring_sent(KTPUring *u, int n, int res) {
+    u->inflight--;
+    if (res >= 0) {
+        return;
+    }
+    KTPSocket *sock = ktp_socket(u->sends[n].sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (res == -EIO && !sock->is_free && sock->udp_socket == u->sends[n].udp_socket &&
+        (sock->offload & KTP_OFFLOAD_GSO)) {
+        int zero = 0;
+        setsockopt(sock->udp_socket, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+        sock->offload &= ~KTP_OFFLOAD_GSO;
+    } else if (res != -EIO && res != -EBADF) {
+        errno = -res;
+        perror("io_uring sendmsg");
+    }
+    pthread_mutex_unlock(&sock->lock);
+}
+
+/* Ends a run of datagrams handled for socket i, as receive_socket() ends
+ * a batch. */
+static void uring_release(int i, int queued_before, int sending_before) {
+    KTPSocket *sock = ktp_socket(i);
+    int data_arrived = sock->recv_buffer_size > queued_before;
+    int space_freed = sock->swnd.size + sock->send_buffer_size < sending_before;
+    pthread_mutex_unlock(&sock->lock);
+    if (data_arrived) {
+        pthread_cond_broadcast(&sock->recv_cond);
+    }
+    if (space_freed) {
+        pthread_cond_broadcast(&sock->send_cond);
+    }
+}
+
+/* Handles the completions on a worker's ring. Datagrams go through
+ * handle_packet()'s copy path, each run of them for one socket under one
+ * hold of its lock, and their buffers back on the buffer ring. A receive
+ * that ends (for instance when the buffer ring ran dry) is posted again on
+ * the next round. */
+static void uring_reap(KTPUring *u) {
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    int locked = -1, queued_before = 0, sending_before = 0;
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        int type = cqe->user_data >> 56;
+        int i = (uint32_t)cqe->user_data;
+        char *buf = NULL;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            buf = u->buffers + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+        }
+        if (locked != -1 && (type != URING_RECV || i != locked)) {
+            uring_release(locked, queued_before, sending_before);
+            locked = -1;
+        }
+
+        if (type == URING_SEND) {
+            uring_sent(u, i, cqe->res);
+        } else if (type == URING_DOORBELL) {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                u->doorbell_armed = 0;
+            }
+        } else if ((uint32_t)(cqe->user_data >> 32 & 0xffffff) == (RECV_GEN(i) & 0xffffff)) {
+            KTPSocket *sock = ktp_socket(i);
+            if (locked == -1) {
+                pthread_mutex_lock(&sock->lock);
+                locked = i;
+                queued_before = sock->recv_buffer_size;
+                sending_before = sock->swnd.size + sock->send_buffer_size;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                RECV_ARMED(i) = 0;
+                if (sock->is_free) {
+                    pthread_cond_broadcast(&sock->recv_cond);
+                }
+            }
+            if (!sock->is_free && buf != NULL && cqe->res >= 0) {
+                struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+                char *packet = buf + sizeof(*out) + u->recv_msg.msg_namelen;
+                ssize_t len = (out->flags & MSG_TRUNC) ? -1 : (ssize_t)out->payloadlen;
+                if (sock->backlog > 0) {
+                    uring_release(locked, queued_before, sending_before);
+                    locked = -1;
+                    listener_packet(i, (struct sockaddr_in *)(out + 1), (KTPHeader *)packet,
+                                    packet + sizeof(KTPHeader), len);
+                } else {
+                    handle_packet(i, (KTPHeader *)packet, packet + sizeof(KTPHeader), len, -1);
+                }
+            }
+        }
+        if (buf != NULL) {
+            uring_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+    }
+    if (locked != -1) {
+        uring_release(locked, queued_before, sending_before);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+    if (u->inflight == 0) {
+        u->nsends = 0;
+        u->arena_used = 0;
+    }
+}
+
+/* Reads every datagram waiting on socket i, then wakes its application. */
+static void receive_socket(KTPEngineWorker *w, int i) {
+    KTPSocket *sock = ktp_socket(i);
+    struct mmsghdr *msgs = w->msgs;
+    struct iovec (*iovs)[2] = w->iovs;
+    int *posted = w->posted;
+
+    int udp_socket = sock->udp_socket;
+
+    /* Edge-triggered: keep reading until the socket is drained. */
+    while (!sock->is_free) {
+        pthread_mutex_lock(&sock->lock);
+        if (sock->is_free || sock->udp_socket != udp_socket) {
+            pthread_mutex_unlock(&sock->lock);
+            break;
+        }
+
+        /* Payloads are scattered straight into free receive slots. Those
+         * are off the free ring and the socket is pinned, so the read runs
+         * without the lock. */
+        KTPRecvSlot *slots = recv_slots(i);
+        for (int k = 0; k < KTP_BATCH; k++) {
+            posted[k] = sock->recv_free_count > 0 ? free_slot_pop(i) : -1;
+            iovs[k][1].iov_base = posted[k] >= 0 ? slots[posted[k]].data : w->scratch[k];
+        }
+        sock->pins++;
+        pthread_mutex_unlock(&sock->lock);
+        int received = recvmmsg(udp_socket, msgs, KTP_BATCH, MSG_DONTWAIT, NULL);
+        int err = errno;
+        pthread_mutex_lock(&sock->lock);
+        int unpinned = unpin_socket(sock);
+        if (received < 0 || sock->is_free) {
+            for (int k = 0; k < KTP_BATCH; k++) {
+                if (posted[k] >= 0) {
+                    free_slot_push(i, posted[k]);
+                }
+            }
+            pthread_mutex_unlock(&sock->lock);
+            if (unpinned) {
+                pthread_cond_broadcast(&sock->send_cond);
+            }
+            if (received < 0 && err != EAGAIN && err != EWOULDBLOCK) {
+                errno = err;
+                perror("recvmmsg");
+            }
+            break;
+        }
+
+        int queued_before = sock->recv_buffer_size;
+        int sending_before = sock->swnd.size + sock->send_buffer_size;
+        for (int k = 0; k < KTP_BATCH; k++) {
+            int consumed = 0;
+            if (k < received) {
+                consumed = handle_packet(i, &w->headers[k], iovs[k][1].iov_base,
+                                         msgs[k].msg_len, posted[k]);
+            }
+            if (posted[k] >= 0 && !consumed) {
+                free_slot_push(i, posted[k]);
+            }
+        }
+        int data_arrived = sock->recv_buffer_size > queued_before;
+        int space_freed = sock->swnd.size + sock->send_buffer_size < sending_before;
+        pthread_mutex_unlock(&sock->lock);
+
+        if (data_arrived) {
+            pthread_cond_broadcast(&sock->recv_cond);
+        }
+        if (space_freed || unpinned) {
+            pthread_cond_broadcast(&sock->send_cond);
+        }
+
+        if (received < KTP_BATCH) {
+            break;
+        }
+    }
+}
+
+#define GRO_BUFFER_SIZE 65536
+
+/* receive_socket() for sockets with UDP_GRO on. One read may return several
+ * packets from the same sender glued together, all of the size given by the
+ * UDP_GRO control message except possibly the last. They cannot be scattered
+ * into receive slots, so every payload goes through handle_packet()'s copy
+ * path. */
+static void receive_gro(KTPEngineWorker *w, int i) {
+    KTPSocket *sock = ktp_socket(i);
+    struct mmsghdr msgs[KTP_GRO_BATCH];
+    struct iovec iovs[KTP_GRO_BATCH];
+    char control[KTP_GRO_BATCH][CMSG_SPACE(sizeof(int))];
+
+    if (w->gro_buffers == NULL && (w->gro_buffers = malloc(KTP_GRO_BATCH * GRO_BUFFER_SIZE)) == NULL) {
+        perror("malloc");
+        return;
+    }
+    int udp_socket = sock->udp_socket;
+
+    while (!sock->is_free) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int k = 0; k < KTP_GRO_BATCH; k++) {
+            iovs[k].iov_base = w->gro_buffers + k * GRO_BUFFER_SIZE;
+            iovs[k].iov_len = GRO_BUFFER_SIZE;
+            msgs[k].msg_hdr.msg_iov = &iovs[k];
+            msgs[k].msg_hdr.msg_iovlen = 1;
+            msgs[k].msg_hdr.msg_control = control[k];
+            msgs[k].msg_hdr.msg_controllen = sizeof(control[k]);
+        }
+        /* The pin keeps the UDP socket open while the lock is dropped. */
+        pthread_mutex_lock(&sock->lock);
+        if (sock->is_free || sock->udp_socket != udp_socket) {
+            pthread_mutex_unlock(&sock->lock);
+            break;
+        }
+        sock->pins++;
+        pthread_mutex_unlock(&sock->lock);
+        int received = recvmmsg(udp_socket, msgs, KTP_GRO_BATCH, MSG_DONTWAIT, NULL);
+        int err = errno;
+        pthread_mutex_lock(&sock->lock);
+        int unpinned = unpin_socket(sock);
+        if (received < 0 || sock->is_free) {
+            pthread_mutex_unlock(&sock->lock);
+            if (unpinned) {
+                pthread_cond_broadcast(&sock->send_cond);
+            }
+            if (received < 0 && err != EAGAIN && err != EWOULDBLOCK) {
+                errno = err;
+                perror("recvmmsg");
+            }
+            break;
+        }
+
+        int queued_before = sock->recv_buffer_size;
+        int sending_before = sock->swnd.size + sock->send_buffer_size;
+        for (int k = 0; k < received; k++) {
+            size_t total = msgs[k].msg_len;
+            size_t segment = total;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[k].msg_hdr); cmsg != NULL;
+                 cmsg = CMSG_NXTHDR(&msgs[k].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int size;
+                    memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                    if (size > 0) {
+                        segment = size;
+                    }
+                }
+            }
+            char *data = iovs[k].iov_base;
+            for (size_t offset = 0; offset < total; offset += segment) {
+                size_t len = total - offset < segment ? total - offset : segment;
+                KTPHeader header = {0};
+                memcpy(&header, data + offset, len < sizeof(header) ? len : sizeof(header));
+                handle_packet(i, &header, data + offset + sizeof(KTPHeader), len, -1);
+            }
+        }
+        int data_arrived = sock->recv_buffer_size > queued_before;
+        int space_freed = sock->swnd.size + sock->send_buffer_size < sending_before;
+        pthread_mutex_unlock(&sock->lock);
+
+        if (data_arrived) {
+            pthread_cond_broadcast(&sock->recv_cond);
+        }
+        if (space_freed || unpinned) {
+            pthread_cond_broadcast(&sock->send_cond);
+        }
+
+        if (received < KTP_GRO_BATCH) {
+            break;
+        }
+    }
+}
+
+/* Queues a window update on every socket whose full receive buffer has
+ * gained space, in case the one sent when it did was lost. */
+static void probe_windows(const int *ids, int count) {
+    for (int n = 0; n < count; n++) {
+        int i = ids[n];
+        KTPSocket *sock = ktp_socket(i);
+        pthread_mutex_lock(&sock->lock);
+        int update = !sock->is_free && sock->nospace_flag && 
+                     sock->recv_buffer_size < sock->rcv_wnd;
+        if (update) {
+            queue_ack(i, sock->last_ack_seq, 0, 1);
+            TRACE(KTP_TRACE_LOSS, i, KTP_EV_WINDOW_UPDATE, sock->last_ack_seq,
+                  sock->rcv_wnd - sock->recv_buffer_size);
+        }
+        pthread_mutex_unlock(&sock->lock);
+    }
+}
+
+/* Retransmits every in-flight packet of a socket whose RTO has expired and
+ * re-arms the socket's timer for the next one due. Packets that do not fit
+ * in the batch stay due and re-arm the timer immediately. Caller holds the
+ * socket lock. */
+void retransmit_due(KTPBatch *batch, int i, uint64_t now) {
+    KTPSocket *sock = ktp_socket(i);
+    KTPSendSlot *slots = send_slots(i);
+    uint64_t next_deadline = 0;
+    int expired = 0;
+
+    for (int j = 0; j < sock->swnd.size; j++) {
+        int slot = SEND_SLOT(sock, j);
+        if (slots[slot].acked) {
+            continue;
+        }
+        uint64_t deadline = slots[slot].send_time + sock->rtt.rto;
+        if (deadline <= now) {
+            if (!batch_add_slot(batch, i, slot)) {
+                next_deadline = now;
+                break;
+            }
+            TRACE(KTP_TRACE_LOSS, i, KTP_EV_RETRANSMIT, slots[slot].seq_num, sock->swnd.size);
+            slots[slot].send_time = now;
+            slots[slot].retransmitted = 1;
+            sock->cc.retransmits++;
+            STAT_ADD(sock, retransmits, 1);
+            expired = 1;
+        } else if (next_deadline == 0 || deadline < next_deadline) {
+            next_deadline = deadline;
+        }
+    }
+
+    if (expired) {
+        cc_on_timeout(sock);
+        TRACE(KTP_TRACE_LOSS, i, KTP_EV_TIMEOUT, slots[sock->swnd.head].seq_num, sock->cc.cwnd);
+        sock->rtt.rto *= 2;
+        if (sock->rtt.rto > RTO_MAX_MS * 1000000ULL) {
+            sock->rtt.rto = RTO_MAX_MS * 1000000ULL;
+        }
+        sock->rtt.backoff++;
+        uint64_t deadline = now + sock->rtt.rto;
+        if (next_deadline == 0 || deadline < next_deadline) {
+            next_deadline = deadline;
+        }
+    }
+    if (next_deadline != 0) {
+        timer_schedule(i, next_deadline);
+    }
+}
+
+/* Queues every packet due on one socket -- expired retransmissions, a fast
+ * retransmit, new data and then any ACK that could not ride on them -- and
+ * sends them with a single sendmmsg. The payloads are sent from the slots
+ * themselves, pinned by batch_flush() while the lock is dropped for it. */
+void service_socket(KTPBatch *batch, int i, uint64_t now, int timer_expired) {
+    KTPSocket *sock = ktp_socket(i);
+
+    pthread_mutex_lock(&sock->lock);
+    if (sock->is_free) {
+        pthread_mutex_unlock(&sock->lock);
+        return;
+    }
+    KTPSendSlot *slots = send_slots(i);
+    batch->sockfd = i;
+    batch->udp_socket = sock->udp_socket;
+    batch->addr = sock->remote_addr;
+
+    if (sock->ack_deadline != 0 && sock->ack_deadline <= now) {
+        queue_ack(i, sock->ack_seq, sock->ack_nospace, 1);
+    }
+
+    if (timer_expired) {
+        retransmit_due(batch, i, now);
+        if (sock->ack_deadline != 0) {
+            timer_schedule_before(i, sock->ack_deadline);
+        }
+    }
+
+    if (sock->swnd.fast_retransmit && sock->swnd.size > 0) {
+        int slot = sock->swnd.head;
+        if (batch_add_slot(batch, i, slot)) {
+            sock->swnd.fast_retransmit = 0;
+            slots[slot].send_time = now;
+            slots[slot].retransmitted = 1;
+            sock->cc.retransmits++;
+            STAT_ADD(sock, retransmits, 1);
+            TRACE(KTP_TRACE_LOSS, i, KTP_EV_FAST_RETRANSMIT, slots[slot].seq_num, sock->swnd.size);
+        }
+    }
+
+    /* New data is limited by the peer's window and cwnd, and paced: each
+     * message is due pacing_interval() after the previous one, and is sent
+     * once it is due within PACING_SLACK_NS. Otherwise the socket's timer is
+     * pulled forward to the next send time. */
+    int armed = timer_armed(i);
+    int paced = 0;
+    uint64_t interval = pacing_interval(sock);
+    /* With the peer's window closed and nothing in flight, the update that
+     * reopens it may have been lost. After an RTO one message goes out
+     * anyway; the peer accepts it or answers that it has no space, and it
+     * is retransmitted like any other until then. */
+    int probe = sock->window_probe != 0 && sock->window_probe <= now;
+    if (sock->fec == 0 && FEC_STATE(i) != NULL && FEC_STATE(i)->block.count > 0) {
+        fec_discard(FEC_STATE(i));
+    }
+    while (sock->send_buffer_size > 0 &&
+           (sock->rwnd.size > 0 || probe) &&
+           (uint32_t)sock->swnd.size < sock->cc.cwnd &&
+           batch->count + sock->ack_pending + (sock->fec != 0) < KTP_BATCH) {
+        
+        if (sock->cc.next_send < now) {
+            sock->cc.next_send = now;
+        } else if (sock->cc.next_send > now + PACING_SLACK_NS) {
+            timer_schedule_before(i, sock->cc.next_send - PACING_SLACK_NS);
+            sock->cc.paced_waits++;
+            paced = 1;
+            break;
+        }
+        sock->cc.next_send += interval;
+
+        uint32_t next_seq_num = sock->next_seq_num;
+        int slot = SEND_SLOT(sock, sock->swnd.size);
+        
+        slots[slot].seq_num = next_seq_num;
+        batch_add_slot(batch, i, slot);
+        if (sock->fec != 0) {
+            fec_send(batch, i, &slots[slot]);
+        }
+        
+        slots[slot].send_time = now;
+        slots[slot].acked = 0;
+        slots[slot].retransmitted = 0;
+        if (!armed) {
+            timer_schedule(i, now + sock->rtt.rto);
+            armed = 1;
+        }
+        
+        sock->swnd.size++;
+        sock->send_buffer_size--;
+        if (sock->rwnd.size > 0) {
+            sock->rwnd.size--;
+        }
+        probe = 0;
+        sock->next_seq_num = next_seq_num + 1; 
+        sock->cc.packets_sent++;
+        
+        TRACE(KTP_TRACE_ALL, i, KTP_EV_SEND, next_seq_num, sock->swnd.size);
+    }
+
+    /* Window stall: data is waiting but the peer's window or cwnd is
+     * closed. */
+    int stalled = sock->send_buffer_size > 0 &&
+                  (sock->rwnd.size == 0 || (uint32_t)sock->swnd.size >= sock->cc.cwnd);
+    if (stalled && sock->stall_start == 0) {
+        sock->stall_start = now;
+    } else if (!stalled && sock->stall_start != 0) {
+        STAT_ADD(sock, stall_ns, now - sock->stall_start);
+        sock->stall_start = 0;
+    }
+    if (sock->send_buffer_size > 0 && sock->rwnd.size == 0 && sock->swnd.size == 0) {
+        if (sock->window_probe == 0) {
+            sock->window_probe = now + sock->rtt.rto;
+        }
+        timer_schedule_before(i, sock->window_probe);
+    } else {
+        sock->window_probe = 0;
+    }
+
+    /* ACKs that did not ride on data go out on their own. */
+    if (sock->ack_pending > 0) {
+        batch_add_acks(batch, i);
+    }
+
+    int more = sock->ack_pending > 0 || sock->swnd.fast_retransmit ||
+               (!paced && sock->send_buffer_size > 0 && sock->rwnd.size > 0 &&
+                (uint32_t)sock->swnd.size < sock->cc.cwnd);
+    batch_flush(batch);
+
+    if (more) {
+        wake_socket(i);
+    }
+}
+
+/* Arms the worker's timerfd for deadline (0 disarms it) unless it already
+ * is. */
+static void arm_timer(KTPEngineWorker *w, uint64_t deadline) {
+    if (deadline == w->timer_armed) {
+        return;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / 1000000000ULL;
+    spec.it_value.tv_nsec = deadline % 1000000000ULL;
+    if (timerfd_settime(w->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+    }
+    w->timer_armed = deadline;
+}
+
+/* Restricts a worker to its CPU from KTP_CPUS, if one was given, and
+ * records it for ktpstat. */
+static void pin_worker(int n) {
+    if (worker_ncpus == 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker_cpus[n % worker_ncpus], &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_setaffinity_np");
+    } else {
+        ktp_table->workers[n].cpu = worker_cpus[n % worker_ncpus];
+    }
+}
+
+/* Copies the ids of the worker's sockets into *ids (grown as needed) and
+ * returns how many there are. */
+static int shard_sockets(KTPEngineWorker *w, int **ids, int *capacity) {
+    pthread_mutex_lock(&w->shard_lock);
+    if (*capacity < w->shard_size) {
+        *capacity = w->shard_capacity;
+        *ids = realloc(*ids, *capacity * sizeof(int));
+        if (*ids == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    int count = w->shard_size;
+    memcpy(*ids, w->shard, count * sizeof(int));
+    pthread_mutex_unlock(&w->shard_lock);
+    return count;
+}
+
+/* Worker n's event loop. Each round expires its timers, sends held
+ * packets that are due and services every socket of its shard, then sleeps
+ * in epoll_wait until a datagram, the doorbell or the timerfd, unless
+ * wake_worker() was called since the round started. With io_uring the
+ * round's sends go out in the same io_uring_enter that waits, with the
+ * next deadline as its timeout in place of the timerfd. */
+void *worker_thread(void *arg) {
+    int n = (int)(intptr_t)arg;
+    KTPEngineWorker *w = &workers[n];
+    KTPWorker *shared = &ktp_table->workers[n];
+    KTPTimerHeap *timers = &timer_heaps[n];
+    struct epoll_event events[KTP_EPOLL_EVENTS];
+    int *ids = NULL, ids_capacity = 0;
+    uint64_t next_probe = monotonic_ns() + T * 1000000000ULL;
+
+    current_worker = n;
+    current_uring = w->uring;
+    pin_worker(n);
+    while (1) {
+        uint32_t work = __atomic_load_n(&shared->work, __ATOMIC_SEQ_CST);
+
+        uint64_t current_time = monotonic_ns();
+        pthread_mutex_lock(&timers->lock);
+        while (timers->size > 0 && TIMER_DEADLINE(timers->heap[0]) <= current_time) {
+            int i = timers->heap[0];
+            timer_remove(timers, i);
+            ktp_chunk(i)->expired[i % KTP_CHUNK_SOCKETS] = 1;
+        }
+        pthread_mutex_unlock(&timers->lock);
+        impair_release(&delay_heaps[n], current_time);
+
+        int count = shard_sockets(w, &ids, &ids_capacity);
+        if (current_time >= next_probe) {
+            probe_windows(ids, count);
+            next_probe = current_time + T * 1000000000ULL;
+        }
+        for (int k = 0; k < count; k++) {
+            int i = ids[k];
+            if (w->uring != NULL && !RECV_ARMED(i)) {
+                uring_arm(w->uring, i);
+            }
+            unsigned char *expired = &ktp_chunk(i)->expired[i % KTP_CHUNK_SOCKETS];
+            service_socket(&w->batch, i, current_time, *expired);
+            *expired = 0;
+        }
+
+        pthread_mutex_lock(&timers->lock);
+        uint64_t deadline = timers->size > 0 ? TIMER_DEADLINE(timers->heap[0]) : next_probe;
+        pthread_mutex_unlock(&timers->lock);
+        uint64_t due = delay_next_due(&delay_heaps[n]);
+        if (due != 0 && due < deadline) {
+            deadline = due;
+        }
+        if (deadline > next_probe) {
+            deadline = next_probe;
+        }
+
+        if (w->uring != NULL) {
+            KTPUring *u = w->uring;
+            if (!u->doorbell_armed && uring_recv(u, u->doorbell, URING_DATA(URING_DOORBELL, 0, 0)) == 0) {
+                u->doorbell_armed = 1;
+            }
+            __atomic_store_n(&shared->sleeping, 1, __ATOMIC_SEQ_CST);
+            int idle = __atomic_load_n(&shared->work, __ATOMIC_SEQ_CST) == work;
+            uint64_t now = monotonic_ns();
+            uring_submit(u, idle && deadline > now ? 1 : 0, deadline > now ? deadline - now : 0);
+            __atomic_store_n(&shared->sleeping, 0, __ATOMIC_SEQ_CST);
+            uring_reap(u);
+            continue;
+        }
+        arm_timer(w, deadline);
+
+        /* sleeping tells wakers whether the doorbell needs ringing. */
+        __atomic_store_n(&shared->sleeping, 1, __ATOMIC_SEQ_CST);
+        int idle = __atomic_load_n(&shared->work, __ATOMIC_SEQ_CST) == work;
+        int ready = epoll_wait(w->epoll_fd, events, KTP_EPOLL_EVENTS, idle ? -1 : 0);
+        __atomic_store_n(&shared->sleeping, 0, __ATOMIC_SEQ_CST);
+
+        for (int e = 0; e < ready; e++) {
+            uint32_t event = events[e].data.u32;
+            if (event == EVENT_DOORBELL) {
+                char byte;
+                while (recv(w->doorbell, &byte, sizeof(byte), MSG_DONTWAIT) >= 0) {
+                }
+            } else if (event == EVENT_TIMER) {
+                uint64_t expirations;
+                if (read(w->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    perror("read timerfd");
+                }
+                w->timer_armed = 0;
+            } else if (ktp_socket(event)->backlog > 0) {
+                receive_listener(w, event);
+            } else if (ktp_socket(event)->offload & KTP_OFFLOAD_GRO) {
+                receive_gro(w, event);
+            } else {
+                receive_socket(w, event);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Sets up ktp_table->nworkers workers: KTP_WORKERS of them, one per online
+ * CPU by default, pinned to the CPUs listed in KTP_CPUS (e.g. "0,2,4") if
+ * set. Each gets an epoll set, a timerfd and a doorbell socket on
+ * loopback, and with KTP_IO=uring an io_uring, unless the kernel cannot
+ * give every worker one. */
+static void init_workers() {
+    const char *env = getenv("KTP_WORKERS");
+    int nworkers = env != NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) {
+        nworkers = 1;
+    } else if (nworkers > KTP_MAX_WORKERS) {
+        nworkers = KTP_MAX_WORKERS;
+    }
+
+    env = getenv("KTP_CPUS");
+    if (env != NULL) {
+        char *copy = strdup(env), *saveptr;
+        for (char *tok = strtok_r(copy, ",", &saveptr); tok != NULL && worker_ncpus < KTP_MAX_WORKERS;
+             tok = strtok_r(NULL, ",", &saveptr)) {
+            worker_cpus[worker_ncpus++] = atoi(tok);
+        }
+        free(copy);
+    }
+
+    workers = calloc(nworkers, sizeof(KTPEngineWorker));
+    timer_heaps = calloc(nworkers, sizeof(KTPTimerHeap));
+    delay_heaps = calloc(nworkers, sizeof(KTPDelayHeap));
+    if (workers == NULL || timer_heaps == NULL || delay_heaps == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int n = 0; n < nworkers; n++) {
+        KTPEngineWorker *w = &workers[n];
+        pthread_mutex_init(&w->shard_lock, NULL);
+        pthread_mutex_init(&timer_heaps[n].lock, NULL);
+        pthread_mutex_init(&delay_heaps[n].lock, NULL);
+        for (int k = 0; k < KTP_BATCH; k++) {
+            w->iovs[k][0].iov_base = &w->headers[k];
+            w->iovs[k][0].iov_len = sizeof(KTPHeader);
+            w->iovs[k][1].iov_len = MESSAGE_SIZE;
+            w->msgs[k].msg_hdr.msg_iov = w->iovs[k];
+            w->msgs[k].msg_hdr.msg_iovlen = 2;
+        }
+
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        w->doorbell = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (w->epoll_fd == -1 || w->timer_fd == -1 || w->doorbell == -1 ||
+            bind(w->doorbell, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            getsockname(w->doorbell, (struct sockaddr *)&addr, &addrlen) == -1) {
+            perror("init_workers");
+            exit(1);
+        }
+        ktp_table->workers[n].doorbell_port = addr.sin_port;
+        ktp_table->workers[n].cpu = -1;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = EVENT_DOORBELL;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->doorbell, &event);
+        event.data.u32 = EVENT_TIMER;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &event);
+    }
+
+    env = getenv("KTP_IO");
+    ktp_table->io_backend = KTP_IO_EPOLL;
+    if (env != NULL && strcmp(env, "uring") == 0) {
+        int n = 0;
+        for (; n < nworkers; n++) {
+            workers[n].uring = calloc(1, sizeof(KTPUring));
+            if (workers[n].uring == NULL || uring_init(workers[n].uring, workers[n].doorbell) == -1) {
+                free(workers[n].uring);
+                workers[n].uring = NULL;
+                break;
+            }
+        }
+        if (n < nworkers) {
+            fprintf(stderr, "io_uring unavailable, using epoll\n");
+            while (n-- > 0) {
+                uring_free(workers[n].uring);
+                free(workers[n].uring);
+                workers[n].uring = NULL;
+            }
+        } else {
+            ktp_table->io_backend = KTP_IO_URING;
+        }
+    }
+    ktp_table->nworkers = nworkers;
+
+    /* Like slot segments, the trace segment is removed at once and lives
+     * until the last process detaches. */
+    env = getenv("KTP_TRACE");
+    ktp_table->trace_level = env != NULL ? atoi(env) : KTP_TRACE_LOSS;
+    ktp_table->trace_shmid = shmget(IPC_PRIVATE, nworkers * sizeof(KTPTraceRing), 0666 | IPC_CREAT);
+    trace_rings = ktp_table->trace_shmid == -1 ? (void *)-1 : shmat(ktp_table->trace_shmid, NULL, 0);
+    if (trace_rings == (void *)-1) {
+        perror("init_workers: trace rings");
+        exit(1);
+    }
+    shmctl(ktp_table->trace_shmid, IPC_RMID, NULL);
+}
+
+static uint32_t peer_hash(const struct sockaddr_in *addr) {
+    uint64_t key = (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static int same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/* Returns listener l's connection with addr, or -1. Caller holds l's
+ * lock. */
+static int peer_lookup(int l, const struct sockaddr_in *addr) {
+    KTPPeerTable *table = PEER_TABLE(l);
+    if (table == NULL) {
+        return -1;
+    }
+    for (int c = table->buckets[peer_hash(addr) & table->mask]; c != -1; c = ktp_socket(c)->next_peer) {
+        if (same_peer(&ktp_socket(c)->remote_addr, addr)) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/* Adds connection c, whose remote_addr is set, to listener l's table,
+ * doubling the buckets once there are as many connections. Caller holds
+ * l's lock. */
+static int peer_insert(int l, int c) {
+    KTPPeerTable *table = PEER_TABLE(l);
+    if (table == NULL) {
+        if ((table = calloc(1, sizeof(KTPPeerTable))) == NULL) {
+            return -1;
+        }
+        PEER_TABLE(l) = table;
+    }
+    uint32_t buckets = table->buckets != NULL ? table->mask + 1 : 0;
+    if (table->count >= (int)buckets) {
+        uint32_t size = buckets ? 2 * buckets : KTP_PEER_BUCKETS;
+        int *grown = malloc(size * sizeof(int));
+        if (grown == NULL) {
+            return -1;
+        }
+        for (uint32_t b = 0; b < size; b++) {
+            grown[b] = -1;
+        }
+        for (uint32_t b = 0; b < buckets; b++) {
+            for (int k = table->buckets[b], next; k != -1; k = next) {
+                next = ktp_socket(k)->next_peer;
+                uint32_t h = peer_hash(&ktp_socket(k)->remote_addr) & (size - 1);
+                ktp_socket(k)->next_peer = grown[h];
+                grown[h] = k;
+            }
+        }
+        free(table->buckets);
+        table->buckets = grown;
+        table->mask = size - 1;
+    }
+    KTPSocket *sock = ktp_socket(c);
+    uint32_t h = peer_hash(&sock->remote_addr) & table->mask;
+    sock->next_peer = table->buckets[h];
+    table->buckets[h] = c;
+    table->count++;
+    return 0;
+}
+
+/* Takes connection c out of listener l's table and accept queue, if it is
+ * still there. */
+static void peer_detach(int l, int c) {
+    KTPSocket *listener = ktp_socket(l);
+    KTPSocket *sock = ktp_socket(c);
+    pthread_mutex_lock(&listener->lock);
+    KTPPeerTable *table = PEER_TABLE(l);
+    if (table != NULL) {
+        for (int *link = &table->buckets[peer_hash(&sock->remote_addr) & table->mask]; *link != -1;
+             link = &ktp_socket(*link)->next_peer) {
+            if (*link == c) {
+                *link = sock->next_peer;
+                table->count--;
+                break;
+            }
+        }
+    }
+    for (int prev = -1, k = listener->accept_head; k != -1; prev = k, k = ktp_socket(k)->next_accept) {
+        if (k == c) {
+            if (prev == -1) {
+                listener->accept_head = sock->next_accept;
+            } else {
+                ktp_socket(prev)->next_accept = sock->next_accept;
+            }
+            if (listener->accept_tail == c) {
+                listener->accept_tail = prev;
+            }
+            listener->accept_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&listener->lock);
+}
+
+/* Returns the ids of listener l's connections in a malloc'd array and their
+ * number in *count. Caller holds l's lock. */
+static int *peer_list(int l, int *count) {
+    KTPPeerTable *table = PEER_TABLE(l);
+    int *ids = malloc((table->count + 1) * sizeof(int));
+    *count = 0;
+    if (ids == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (uint32_t b = 0; table->buckets != NULL && b <= table->mask; b++) {
+        for (int c = table->buckets[b]; c != -1; c = ktp_socket(c)->next_peer) {
+            ids[(*count)++] = c;
+        }
+    }
+    return ids;
+}
+
+/* Allocates and initializes a socket over udp_socket, owned by worker n,
+ * and adds it to the worker's shard. The caller registers the descriptor
+ * with epoll if need be. Returns the socket's id or -1. */
+static int init_socket(int udp_socket, pid_t pid, int n, int snd_wnd, int rcv_wnd) {
+    char *slots;
+    int slots_shmid = create_slots(snd_wnd, rcv_wnd, &slots);
+    if (slots_shmid == -1) {
+        return -1;
+    }
+
+    int i = alloc_socket();
+    if (i == -1) {
+        shmdt(slots);
+        errno = ENOSPACE;
+        return -1;
+    }
+    KTPSocket *sock = ktp_socket(i);
+    sock->worker = n;
+    sock->listener = -1;
+    sock->backlog = 0;
+    sock->accept_head = -1;
+    sock->accept_tail = -1;
+    sock->accept_count = 0;
+    sock->next_accept = -1;
+    sock->next_peer = -1;
+    sock->reuseport = 0;
+    sock->offload = 0;
+    sock->fec = 0;
+    memset(&sock->local_addr, 0, sizeof(sock->local_addr));
+    memset(&sock->remote_addr, 0, sizeof(sock->remote_addr));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&sock->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sock->recv_cond, &cond_attr);
+    pthread_cond_init(&sock->send_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    sock->recv_timeout = 0;
+    sock->send_timeout = 0;
+
+    char *stale = install_slots(i, slots_shmid, slots, snd_wnd, rcv_wnd);
+    if (stale != NULL) {
+        shmdt(stale);
+    }
+
+    sock->pid = pid;
+    sock->udp_socket = udp_socket;
+    sock->pins = 0;
+    sock->pin_wait = 0;
+    sock->send_buffer_size = 0;
+    sock->send_reserved = 0;
+    sock->swnd.head = 0;
+    sock->swnd.size = 0;
+    sock->swnd.cum_ack = 0;
+    sock->swnd.dup_acks = 0;
+    sock->swnd.fast_retransmit = 0;
+    sock->rwnd.size = BUFFER_SIZE;
+    sock->rwnd.next_seq = 0;
+    sock->rwnd.max_seq = 0;
+    sock->rtt.srtt = 0;
+    sock->rtt.rttvar = 0;
+    sock->rtt.rto = RTO_INIT_MS * 1000000ULL;
+    sock->rtt.backoff = 0;
+    sock->last_ack_seq = 0;
+    sock->last_data_time = 0;
+    sock->linger = 0;
+    sock->time_wait = 0;
+    sock->nospace_flag = 0;
+    sock->ack_pending = 0;
+    sock->ack_held = 0;
+    sock->ack_deadline = 0;
+    sock->delack.packets = KTP_DELACK_PACKETS;
+    sock->delack.timeout_us = KTP_DELACK_US;
+    sock->next_seq_num = 0;
+    cc_init(sock, KTP_CC_NEWRENO);
+    memset(&sock->stats, 0, sizeof(sock->stats));
+    memset(&sock->impair, 0, sizeof(sock->impair));
+    sock->impair.loss = P;
+    sock->impair.ge_loss_bad = 1;
+    sock->impair.limit = KTP_IMPAIR_LIMIT;
+    sock->impair.seed = i + 1;
+    impair_seed(sock, sock->impair.seed);
+    sock->impair_queued = 0;
+    sock->impair_link_free = 0;
+    sock->stall_start = 0;
+    sock->window_probe = 0;
+    __atomic_store_n(&sock->is_free, 0, __ATOMIC_RELEASE);
+
+    KTPEngineWorker *w = &workers[n];
+    pthread_mutex_lock(&w->shard_lock);
+    if (w->shard_size == w->shard_capacity) {
+        w->shard_capacity = w->shard_capacity ? 2 * w->shard_capacity : KTP_CHUNK_SOCKETS;
+        w->shard = realloc(w->shard, w->shard_capacity * sizeof(int));
+        if (w->shard == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    w->shard[w->shard_size++] = i;
+    pthread_mutex_unlock(&w->shard_lock);
+    __atomic_add_fetch(&ktp_table->workers[n].sockets, 1, __ATOMIC_RELAXED);
+    return i;
+}
+
+/* Creates a socket on behalf of application process pid. */
+static int engine_socket(int domain, int protocol, pid_t pid) {
+    int udp_socket = socket(domain, SOCK_DGRAM, protocol);
+    if (udp_socket == -1) {
+        return -1;
+    }
+
+    /* New sockets go to the worker with the fewest. */
+    int n = 0;
+    for (int k = 1; k < ktp_table->nworkers; k++) {
+        if (ktp_table->workers[k].sockets < ktp_table->workers[n].sockets) {
+            n = k;
+        }
+    }
+    int i = init_socket(udp_socket, pid, n, BUFFER_SIZE, BUFFER_SIZE);
+    if (i == -1) {
+        close(udp_socket);
+        return -1;
+    }
+
+    /* The worker posts an io_uring socket's receive on its next round. */
+    if (workers[n].uring != NULL) {
+        wake_worker(n);
+        return i;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u32 = i;
+    if (epoll_ctl(workers[n].epoll_fd, EPOLL_CTL_ADD, udp_socket, &event) == -1) {
+        int err = errno;
+        engine_close(i);
+        errno = err;
+        return -1;
+    }
+    return i;
+}
+
+/* Sockets in TIME_WAIT. Command thread only. */
+static int *lingering = NULL;
+static int nlingering = 0, lingering_capacity = 0;
+
+/* Closes a socket on behalf of its application. One that received a file
+ * instead enters TIME_WAIT: the peer only finishes once the ACK of the
+ * last chunk gets through, so a lost one must still be repeated when the
+ * peer retransmits. */
+static int engine_release(int sockfd) {
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    int linger = sock->linger && !sock->is_free && sock->last_data_time != 0;
+    if (linger) {
+        sock->time_wait = 1;
+    }
+    pthread_mutex_unlock(&sock->lock);
+    if (!linger) {
+        return engine_close(sockfd);
+    }
+    if (nlingering == lingering_capacity) {
+        lingering_capacity = lingering_capacity ? 2 * lingering_capacity : 16;
+        lingering = realloc(lingering, lingering_capacity * sizeof(int));
+        if (lingering == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    lingering[nlingering++] = sockfd;
+    return 0;
+}
+
+/* Closes the sockets whose TIME_WAIT is over and returns how long until
+ * the next one's ends, at most limit (ns). */
+static uint64_t expire_time_wait(uint64_t limit) {
+    uint64_t now = monotonic_ns(), next = limit;
+    uint64_t time_wait = KTP_TIME_WAIT_MS * 1000000ULL;
+    for (int n = 0; n < nlingering;) {
+        KTPSocket *sock = ktp_socket(lingering[n]);
+        pthread_mutex_lock(&sock->lock);
+        uint64_t quiet = now - sock->last_data_time;
+        pthread_mutex_unlock(&sock->lock);
+        if (quiet >= time_wait) {
+            engine_close(lingering[n]);
+            lingering[n] = lingering[--nlingering];
+            continue;
+        }
+        if (time_wait - quiet < next) {
+            next = time_wait - quiet;
+        }
+        n++;
+    }
+    return next;
+}
+
+/* Ends the TIME_WAIT of any socket bound to addr's port and address, so a
+ * new socket can take the port over, as with SO_REUSEADDR. */
+static void end_time_wait(const struct sockaddr_in *addr) {
+    for (int n = 0; n < nlingering;) {
+        const struct sockaddr_in *local = &ktp_socket(lingering[n])->local_addr;
+        if (local->sin_port == addr->sin_port &&
+            (local->sin_addr.s_addr == addr->sin_addr.s_addr || local->sin_addr.s_addr == INADDR_ANY ||
+             addr->sin_addr.s_addr == INADDR_ANY)) {
+            engine_close(lingering[n]);
+            lingering[n] = lingering[--nlingering];
+            continue;
+        }
+        n++;
+    }
+}
+
+/* Binds a socket's UDP descriptor, which only the engine holds. */
+static int engine_bind(int sockfd, const struct sockaddr_in *local_addr,
+                       const struct sockaddr_in *remote_addr) {
+    KTPSocket *sock = ktp_socket(sockfd);
+    int one = 1;
+    if (sock->reuseport &&
+        setsockopt(sock->udp_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        return -1;
+    }
+    end_time_wait(local_addr);
+    if (bind(sock->udp_socket, (const struct sockaddr *)local_addr, sizeof(struct sockaddr_in)) == -1) {
+        return -1;
+    }
+    /* Offloads the kernel does not support are silently dropped; the
+     * socket then sends and reads one datagram per packet. */
+    int offload = sock->offload;
+    int segment = sizeof(KTPHeader) + MESSAGE_SIZE;
+    if ((offload & KTP_OFFLOAD_GSO) &&
+        setsockopt(sock->udp_socket, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == -1) {
+        offload &= ~KTP_OFFLOAD_GSO;
+    }
+    if (ktp_table->io_backend == KTP_IO_URING) {
+        offload &= ~KTP_OFFLOAD_GRO;
+    }
+    if ((offload & KTP_OFFLOAD_GRO) &&
+        setsockopt(sock->udp_socket, SOL_UDP, UDP_GRO, &one, sizeof(one)) == -1) {
+        offload &= ~KTP_OFFLOAD_GRO;
+    }
+    /* Sockets sharing a port are connected to their peers, so the kernel
+     * hands each one its own peer's datagrams. */
+    if (sock->reuseport &&
+        connect(sock->udp_socket, (const struct sockaddr *)remote_addr, sizeof(struct sockaddr_in)) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&sock->lock);
+    sock->local_addr = *local_addr;
+    sock->remote_addr = *remote_addr;
+    sock->offload = offload;
+    pthread_mutex_unlock(&sock->lock);
+    return 0;
+}
+
+static int engine_close(int sockfd) {
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (sock->is_free) {
+        pthread_mutex_unlock(&sock->lock);
+        errno = EBADF;
+        return -1;
+    }
+    int udp_socket = sock->udp_socket;
+    int listener = sock->listener;
+    /* A listener takes its connections down with it. */
+    int *children = NULL, nchildren = 0;
+    if (sock->backlog > 0 && PEER_TABLE(sockfd) != NULL) {
+        children = peer_list(sockfd, &nchildren);
+    }
+    sock->backlog = 0;
+    sock->is_free = 1;
+    sock->udp_socket = -1;
+    if (listener >= 0) {
+        RECV_ARMED(sockfd) = 0;
+    }
+    /* A worker may still be reading or sending with the socket pinned. */
+    wait_unpinned(sock);
+    char *slots = SLOT_CACHE(sockfd).base;
+    SLOT_CACHE(sockfd).base = NULL;
+    SLOT_CACHE(sockfd).shmid = -1;
+    free(FEC_STATE(sockfd));
+    FEC_STATE(sockfd) = NULL;
+    pthread_mutex_unlock(&sock->lock);
+    if (slots != NULL) {
+        shmdt(slots);
+    }
+    pthread_cond_broadcast(&sock->recv_cond);
+    pthread_cond_broadcast(&sock->send_cond);
+
+    int n = sock->worker;
+    KTPEngineWorker *w = &workers[n];
+    timer_cancel(sockfd);
+    delay_purge(&delay_heaps[n], sockfd);
+    if (listener >= 0) {
+        /* The descriptor belongs to the listener. */
+        peer_detach(listener, sockfd);
+    } else {
+        for (int k = 0; k < nchildren; k++) {
+            engine_close(children[k]);
+        }
+        free(children);
+        pthread_mutex_lock(&sock->lock);
+        if (PEER_TABLE(sockfd) != NULL) {
+            free(PEER_TABLE(sockfd)->buckets);
+            free(PEER_TABLE(sockfd));
+            PEER_TABLE(sockfd) = NULL;
+        }
+        pthread_mutex_unlock(&sock->lock);
+        if (w->uring != NULL) {
+            uring_cancel(w->uring, udp_socket);
+        } else {
+            epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, udp_socket, NULL);
+        }
+        close(udp_socket);
+        /* Waits until the port can be bound again. */
+        pthread_mutex_lock(&sock->lock);
+        if (RECV_ARMED(sockfd)) {
+            wake_worker(n);
+        }
+        while (RECV_ARMED(sockfd)) {
+            pthread_cond_wait(&sock->recv_cond, &sock->lock);
+        }
+        pthread_mutex_unlock(&sock->lock);
+    }
+    pthread_mutex_lock(&w->shard_lock);
+    for (int k = 0; k < w->shard_size; k++) {
+        if (w->shard[k] == sockfd) {
+            w->shard[k] = w->shard[--w->shard_size];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->shard_lock);
+    __atomic_sub_fetch(&ktp_table->workers[n].sockets, 1, __ATOMIC_RELAXED);
+    release_socket(sockfd);
+    return 0;
+}
+
+/* Opens listener l's connection with peer, with the listener's options,
+ * and queues it for k_accept(). Runs on the listener's worker. Returns the
+ * connection's id, or -1 if the accept queue is full. */
+static int accept_peer(int l, const struct sockaddr_in *peer) {
+    KTPSocket *listener = ktp_socket(l);
+    pthread_mutex_lock(&listener->lock);
+    if (listener->is_free || listener->backlog == 0 || listener->accept_count >= listener->backlog) {
+        pthread_mutex_unlock(&listener->lock);
+        return -1;
+    }
+    pid_t pid = listener->pid;
+    int udp_socket = listener->udp_socket;
+    int n = listener->worker;
+    int snd_wnd = listener->snd_wnd;
+    int rcv_wnd = listener->rcv_wnd;
+    struct sockaddr_in local_addr = listener->local_addr;
+    int offload = listener->offload;
+    int fec = listener->fec;
+    KTPDelayedAck delack = listener->delack;
+    int algorithm = listener->cc.algorithm;
+    KTPImpairment impair = listener->impair;
+    uint64_t recv_timeout = listener->recv_timeout;
+    uint64_t send_timeout = listener->send_timeout;
+    pthread_mutex_unlock(&listener->lock);
+
+    int c = init_socket(udp_socket, pid, n, snd_wnd, rcv_wnd);
+    if (c == -1) {
+        return -1;
+    }
+    KTPSocket *sock = ktp_socket(c);
+    pthread_mutex_lock(&sock->lock);
+    sock->listener = l;
+    sock->local_addr = local_addr;
+    sock->remote_addr = *peer;
+    sock->offload = offload;
+    sock->fec = fec;
+    sock->delack = delack;
+    cc_init(sock, algorithm);
+    impair.seed = c + 1;
+    sock->impair = impair;
+    impair_seed(sock, impair.seed);
+    sock->recv_timeout = recv_timeout;
+    sock->send_timeout = send_timeout;
+    pthread_mutex_unlock(&sock->lock);
+
+    pthread_mutex_lock(&listener->lock);
+    if (listener->is_free || listener->backlog == 0 || listener->udp_socket != udp_socket ||
+        peer_insert(l, c) == -1) {
+        pthread_mutex_unlock(&listener->lock);
+        engine_close(c);
+        return -1;
+    }
+    if (listener->accept_tail == -1) {
+        listener->accept_head = c;
+    } else {
+        ktp_socket(listener->accept_tail)->next_accept = c;
+    }
+    listener->accept_tail = c;
+    listener->accept_count++;
+    /* All connections' windows land in the one kernel buffer; the kernel
+     * caps this at net.core.rmem_max. */
+    int rcvbuf = PEER_TABLE(l)->count * rcv_wnd * (int)(sizeof(KTPHeader) + MESSAGE_SIZE);
+    pthread_mutex_unlock(&listener->lock);
+    setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    pthread_cond_broadcast(&listener->recv_cond);
+    return c;
+}
+
+/* Hands a datagram that listener l read from peer to the connection with
+ * the peer, which a data packet from a new peer opens. It goes through
+ * handle_packet()'s copy path, as the connection is only known once the
+ * datagram is in. */
+static void listener_packet(int l, const struct sockaddr_in *peer, KTPHeader *header, char *payload,
+                            ssize_t len) {
+    KTPSocket *listener = ktp_socket(l);
+    if (peer->sin_family != AF_INET) {
+        return;
+    }
+    pthread_mutex_lock(&listener->lock);
+    int c = peer_lookup(l, peer);
+    pthread_mutex_unlock(&listener->lock);
+    if (c == -1) {
+        if (len < (ssize_t)sizeof(KTPHeader) || !(header->flags & KTP_FLAG_DATA) ||
+            (c = accept_peer(l, peer)) == -1) {
+            STAT_ADD(listener, drops, 1);
+            return;
+        }
+    }
+
+    KTPSocket *sock = ktp_socket(c);
+    pthread_mutex_lock(&sock->lock);
+    if (sock->is_free || sock->listener != l || !same_peer(&sock->remote_addr, peer)) {
+        pthread_mutex_unlock(&sock->lock);
+        return;
+    }
+    int queued_before = sock->recv_buffer_size;
+    int sending_before = sock->swnd.size + sock->send_buffer_size;
+    handle_packet(c, header, payload, len, -1);
+    int data_arrived = sock->recv_buffer_size > queued_before;
+    int space_freed = sock->swnd.size + sock->send_buffer_size < sending_before;
+    pthread_mutex_unlock(&sock->lock);
+
+    if (data_arrived) {
+        pthread_cond_broadcast(&sock->recv_cond);
+    }
+    if (space_freed) {
+        pthread_cond_broadcast(&sock->send_cond);
+    }
+}
+
+/* receive_socket() for listening sockets: reads datagrams with their
+ * sender's address for listener_packet(). */
+static void receive_listener(KTPEngineWorker *w, int l) {
+    KTPSocket *listener = ktp_socket(l);
+    struct mmsghdr msgs[KTP_BATCH];
+    struct iovec iovs[KTP_BATCH][2];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int k = 0; k < KTP_BATCH; k++) {
+        iovs[k][0].iov_base = &w->headers[k];
+        iovs[k][0].iov_len = sizeof(KTPHeader);
+        iovs[k][1].iov_base = w->scratch[k];
+        iovs[k][1].iov_len = MESSAGE_SIZE;
+        msgs[k].msg_hdr.msg_name = &w->names[k];
+        msgs[k].msg_hdr.msg_iov = iovs[k];
+        msgs[k].msg_hdr.msg_iovlen = 2;
+    }
+    int udp_socket = listener->udp_socket;
+
+    while (!listener->is_free) {
+        pthread_mutex_lock(&listener->lock);
+        if (listener->is_free || listener->udp_socket != udp_socket) {
+            pthread_mutex_unlock(&listener->lock);
+            break;
+        }
+        for (int k = 0; k < KTP_BATCH; k++) {
+            msgs[k].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        listener->pins++;
+        pthread_mutex_unlock(&listener->lock);
+        int received = recvmmsg(udp_socket, msgs, KTP_BATCH, MSG_DONTWAIT, NULL);
+        int err = errno;
+        pthread_mutex_lock(&listener->lock);
+        int unpinned = unpin_socket(listener);
+        pthread_mutex_unlock(&listener->lock);
+        if (unpinned) {
+            pthread_cond_broadcast(&listener->send_cond);
+        }
+        if (received < 0) {
+            errno = err;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvmmsg");
+            }
+            break;
+        }
+
+        for (int k = 0; k < received; k++) {
+            listener_packet(l, &w->names[k], &w->headers[k], w->scratch[k], msgs[k].msg_len);
+        }
+
+        if (received < KTP_BATCH) {
+            break;
+        }
+    }
+}
+
+static void run_command(KTPCommand *command, pid_t pid) {
+    int valid = command->sockfd >= 0 && command->sockfd < ktp_table->capacity &&
+                !ktp_socket(command->sockfd)->is_free && !ktp_socket(command->sockfd)->time_wait;
+    errno = 0;
+    switch (command->op) {
+    case KTP_CMD_SOCKET:
+        command->result = engine_socket(command->domain, command->protocol, pid);
+        break;
+    case KTP_CMD_BIND:
+        command->result = valid ? engine_bind(command->sockfd, &command->local_addr,
+                                              &command->remote_addr) : -1;
+        break;
+    case KTP_CMD_CLOSE:
+        command->result = valid ? engine_release(command->sockfd) : -1;
+        break;
+    default:
+        command->result = -1;
+        errno = EINVAL;
+        break;
+    }
+    if (command->result == -1 && errno == 0) {
+        errno = EBADF;
+    }
+    command->error = errno;
+}
+
+static void ring_push(KTPRing *ring, const KTPCommand *command) {
+    uint32_t head = ring->head;
+    ring->entries[head % KTP_RING_ENTRIES] = *command;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_pop(KTPRing *ring, KTPCommand *command) {
+    uint32_t tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *command = ring->entries[tail % KTP_RING_ENTRIES];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int process_exited(pid_t pid) {
+    return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+/* Closes the sockets of applications that exited without k_close() and
+ * frees their channels. Runs on the command thread every T seconds. */
+void garbage_collector() {
+    static int *ids = NULL, ids_capacity = 0;
+    int count = active_sockets(&ids, &ids_capacity);
+    for (int n = 0; n < count; n++) {
+        pid_t pid = ktp_socket(ids[n])->pid;
+        if (!ktp_socket(ids[n])->time_wait && process_exited(pid)) {
+            fprintf(stderr, "Closing socket %d of exited process %d\n", ids[n], pid);
+            engine_release(ids[n]);
+        }
+    }
+    for (int c = 0; c < KTP_MAX_CLIENTS; c++) {
+        KTPChannel *channel = &ktp_table->channels[c];
+        if (channel->pid != 0 && process_exited(channel->pid)) {
+            channel->requests.head = channel->requests.tail = 0;
+            channel->replies.head = channel->replies.tail = 0;
+            __atomic_store_n(&channel->pid, 0, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* Serves socket, bind and close requests from every application's channel.
+ * Applications wait for each reply, so a reply ring never fills. */
+void *command_thread(void *arg) {
+    uint64_t last_collect = monotonic_ns();
+    while (1) {
+        uint32_t seq = __atomic_load_n(&ktp_table->command_futex, __ATOMIC_ACQUIRE);
+        for (int c = 0; c < KTP_MAX_CLIENTS; c++) {
+            KTPChannel *channel = &ktp_table->channels[c];
+            pid_t pid = __atomic_load_n(&channel->pid, __ATOMIC_ACQUIRE);
+            KTPCommand command;
+            while (pid != 0 && ring_pop(&channel->requests, &command)) {
+                run_command(&command, pid);
+                ring_push(&channel->replies, &command);
+                __atomic_fetch_add(&channel->reply_futex, 1, __ATOMIC_RELEASE);
+                futex_wake(&channel->reply_futex);
             }
         }
-        pthread_mutex_unlock(&mutex);
+
+        uint64_t now = monotonic_ns();
+        if (now - last_collect >= T * 1000000000ULL) {
+            garbage_collector();
+            last_collect = now;
+        }
+        futex_wait(&ktp_table->command_futex, seq, expire_time_wait(T * 1000000000ULL));
     }
     return NULL;
 }
 
+/* Application side of the channels: one per process, claimed on first use
+ * and shared by its threads under channel_lock. */
+static int channel = -1;
+static pthread_mutex_t channel_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void garbage_collector(int signum) {
+static int claim_channel() {
     pid_t pid = getpid();
-    for (int i = 0; i < MAX_KTP_SOCKETS; i++) {
-        if (!shared_memory[i].is_free && shared_memory[i].pid == pid) {
-            shared_memory[i].is_free = 1;
-            close(shared_memory[i].udp_socket);
-            FD_CLR(shared_memory[i].udp_socket, &read_fds);
-            if (shared_memory[i].udp_socket == max_fd) {
-                max_fd = 0;
-                for (int j = 0; j < MAX_KTP_SOCKETS; j++) {
-                    if (!shared_memory[j].is_free && shared_memory[j].udp_socket > max_fd) {
-                        max_fd = shared_memory[j].udp_socket;
-                    }
-                }
-            }
+    for (int c = 0; c < KTP_MAX_CLIENTS; c++) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&ktp_table->channels[c].pid, &expected, pid, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/* Sends a command to initksocket and waits for the reply. Returns its
+ * result, or -1 with errno set. */
+static int engine_call(KTPCommand *command) {
+    pthread_mutex_lock(&channel_lock);
+    if (ktp_table == NULL && init_shared_memory() == -1) {
+        pthread_mutex_unlock(&channel_lock);
+        return -1;
+    }
+    if (channel == -1 || ktp_table->channels[channel].pid != getpid()) {
+        channel = claim_channel();
+        if (channel == -1) {
+            pthread_mutex_unlock(&channel_lock);
+            errno = ENOSPACE;
+            return -1;
+        }
+    }
+
+    KTPChannel *ch = &ktp_table->channels[channel];
+    ring_push(&ch->requests, command);
+    __atomic_fetch_add(&ktp_table->command_futex, 1, __ATOMIC_RELEASE);
+    futex_wake(&ktp_table->command_futex);
+    while (1) {
+        uint32_t seen = __atomic_load_n(&ch->reply_futex, __ATOMIC_ACQUIRE);
+        if (ring_pop(&ch->replies, command)) {
             break;
         }
+        if (!engine_alive()) {
+            pthread_mutex_unlock(&channel_lock);
+            errno = ECONNREFUSED;
+            return -1;
+        }
+        futex_wait(&ch->reply_futex, seen, 1000000000ULL);
+    }
+    pthread_mutex_unlock(&channel_lock);
+
+    if (command->result == -1) {
+        errno = command->error;
     }
+    return command->result;
 }
 
 int k_socket(int domain, int type, int protocol) {
@@ -260,156 +3660,893 @@ int k_socket(int domain, int type, int protocol) {
         return -1;
     }
 
-    static pthread_t receiver, sender;
-    static int initialized = 0;
-    if (!initialized) {
-        init_shared_memory();
-        pthread_create(&receiver, NULL, receiver_thread, NULL);
-        pthread_create(&sender, NULL, sender_thread, NULL);
-        signal(SIGTERM, garbage_collector);
-        initialized = 1;
+    KTPCommand command = {0};
+    command.op = KTP_CMD_SOCKET;
+    command.domain = domain;
+    command.protocol = protocol;
+    int sockfd = engine_call(&command);
+
+    /* KTP_IMPAIR="loss=0.1,delay_us=20000,..." impairs every socket the
+     * process opens, on top of the defaults. */
+    const char *spec = getenv("KTP_IMPAIR");
+    if (sockfd >= 0 && spec != NULL) {
+        KTPImpairment impair;
+        socklen_t len = sizeof(impair);
+        if (k_getsockopt(sockfd, SOL_KTP, KTP_IMPAIR, &impair, &len) == -1 ||
+            k_impair_parse(spec, &impair) == -1 ||
+            k_setsockopt(sockfd, SOL_KTP, KTP_IMPAIR, &impair, sizeof(impair)) == -1) {
+            fprintf(stderr, "KTP_IMPAIR: ignoring invalid setting \"%s\"\n", spec);
+        }
     }
 
-    pthread_mutex_lock(&mutex);
-    for (int i = 0; i < MAX_KTP_SOCKETS; i++) {
-        if (shared_memory[i].is_free) {
-            int udp_socket = socket(domain, SOCK_DGRAM, protocol);
-            if (udp_socket == -1) {
-                pthread_mutex_unlock(&mutex);
-                return -1;
-            }
-            shared_memory[i].is_free = 0;
-            shared_memory[i].pid = getpid();
-            shared_memory[i].udp_socket = udp_socket;
-            shared_memory[i].send_buffer_size = 0;
-            shared_memory[i].recv_buffer_size = 0;
-            shared_memory[i].swnd.size = 0;
-            shared_memory[i].rwnd.size = BUFFER_SIZE;
-            shared_memory[i].last_ack_seq = 0;
-            shared_memory[i].nospace_flag = 0;
-            shared_memory[i].next_seq_num = 0; 
-            FD_SET(udp_socket, &read_fds);
-            if (udp_socket > max_fd) {
-                max_fd = udp_socket;
-            }
-            pthread_mutex_unlock(&mutex);
-            return i; 
-        }
-    }
-    pthread_mutex_unlock(&mutex);
-    errno = ENOSPACE;
-    return -1;
+    /* KTP_OFFLOAD="gso,gro" asks for segmentation offloads on every socket
+     * the process opens. */
+    spec = getenv("KTP_OFFLOAD");
+    if (sockfd >= 0 && spec != NULL) {
+        int offload = (strstr(spec, "gso") ? KTP_OFFLOAD_GSO : 0) | (strstr(spec, "gro") ? KTP_OFFLOAD_GRO : 0);
+        k_setsockopt(sockfd, SOL_KTP, KTP_OFFLOAD, &offload, sizeof(offload));
+    }
+    return sockfd;
 }
+
 int k_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen, 
            const struct sockaddr *remote_addr, socklen_t remote_addrlen) {
            
-    if (sockfd < 0 || sockfd >= MAX_KTP_SOCKETS || shared_memory[sockfd].is_free) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
         errno = EBADF;
         return -1;
     }
 
-    pthread_mutex_lock(&mutex);
-    int udp_socket = shared_memory[sockfd].udp_socket;
-    if (bind(udp_socket, addr, addrlen) == -1) {
-        pthread_mutex_unlock(&mutex);
+    /* An accepted connection shares its listener's port. */
+    if (addrlen < sizeof(struct sockaddr_in) || remote_addrlen < sizeof(struct sockaddr_in) ||
+        ktp_socket(sockfd)->listener >= 0) {
+        errno = EINVAL;
         return -1;
     }
-    memcpy(&shared_memory[sockfd].local_addr, addr, sizeof(struct sockaddr_in));
-    memcpy(&shared_memory[sockfd].remote_addr, remote_addr, sizeof(struct sockaddr_in));
-    pthread_mutex_unlock(&mutex);
-    return 0;
+
+    KTPCommand command = {0};
+    command.op = KTP_CMD_BIND;
+    command.sockfd = sockfd;
+    memcpy(&command.local_addr, addr, sizeof(struct sockaddr_in));
+    memcpy(&command.remote_addr, remote_addr, sizeof(struct sockaddr_in));
+    return engine_call(&command) == -1 ? -1 : 0;
+}
+
+/* Blocks on one of the socket's condition variables until it is signalled
+ * or the deadline (0 = none) passes. Caller holds the socket lock. Returns
+ * ETIMEDOUT once the deadline has passed. */
+static int wait_socket(KTPSocket *sock, pthread_cond_t *cond, uint64_t deadline) {
+    if (deadline == 0) {
+        return pthread_cond_wait(cond, &sock->lock);
+    }
+    if (monotonic_ns() >= deadline) {
+        return ETIMEDOUT;
+    }
+    struct timespec ts = {deadline / 1000000000ULL, deadline % 1000000000ULL};
+    return pthread_cond_timedwait(cond, &sock->lock, &ts);
+}
+
+/* Returns 1 if the next free send slot is still pinned by a send in
+ * progress, asking for send_cond to be broadcast once it is not. Caller
+ * holds the socket lock. */
+static int send_slot_pinned(int sockfd) {
+    KTPSocket *sock = ktp_socket(sockfd);
+    if (!send_slots(sockfd)[SEND_SLOT(sock, sock->swnd.size + sock->send_buffer_size)].pinned) {
+        return 0;
+    }
+    sock->pin_wait = 1;
+    return 1;
+}
+
+/* Waits until the send window has a slot that is neither queued, reserved
+ * nor pinned. Returns 0 with the socket lock still held, or -1 with errno
+ * set and the lock released. */
+static int wait_send_slot(int sockfd, int flags) {
+KTPSocket *sock = ktp_socket(sockfd);
+uint64_t deadline = sock->send_timeout ? monotonic_ns() + sock->send_timeout : 0;
+while (sock->send_reserved || sock->swnd.size + sock->send_buffer_size >= sock->snd_wnd ||
+       send_slot_pinned(sockfd)) {
+if ((flags & MSG_DONTWAIT) || wait_socket(sock, &sock->send_cond, deadline) == ETIMEDOUT) {
+pthread_mutex_unlock(&sock->lock);
+errno = ENOSPACE;
+return -1;
+}
+if (sock->is_free) {
+pthread_mutex_unlock(&sock->lock);
+errno = EBADF;
+return -1;
+}
+}
+return 0;
 }
 
 ssize_t k_sendto(int sockfd, const void *buf, size_t len, int flags, 
     const struct sockaddr *dest_addr, socklen_t addrlen) {
     
-if (sockfd < 0 || sockfd >= MAX_KTP_SOCKETS || shared_memory[sockfd].is_free) {
+if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
 errno = EBADF;
 return -1;
 }
 
-pthread_mutex_lock(&mutex);
+KTPSocket *sock = ktp_socket(sockfd);
+pthread_mutex_lock(&sock->lock);
 
-if (memcmp(dest_addr, &shared_memory[sockfd].remote_addr, sizeof(struct sockaddr_in)) != 0) {
-pthread_mutex_unlock(&mutex);
+if (sock->backlog > 0 || memcmp(dest_addr, &sock->remote_addr, sizeof(struct sockaddr_in)) != 0) {
+pthread_mutex_unlock(&sock->lock);
 errno = ENOTBOUND;
 return -1;
 }
 
-if (shared_memory[sockfd].send_buffer_size >= BUFFER_SIZE) {
-pthread_mutex_unlock(&mutex);
-errno = ENOSPACE;
+if (wait_send_slot(sockfd, flags) == -1) {
 return -1;
 }
 
-memcpy(shared_memory[sockfd].send_buffer[shared_memory[sockfd].send_buffer_size], buf, 
-(len > MESSAGE_SIZE) ? MESSAGE_SIZE : len);
-shared_memory[sockfd].send_buffer_size++;
+size_t copy_len = (len > MESSAGE_SIZE) ? MESSAGE_SIZE : len;
+KTPSendSlot *slot = &send_slots(sockfd)[SEND_SLOT(sock, sock->swnd.size + sock->send_buffer_size)];
+memcpy(slot->data, buf, copy_len);
+slot->length = copy_len;
+sock->send_buffer_size++;
+
+pthread_mutex_unlock(&sock->lock);
+wake_socket(sockfd);
+return copy_len;
+}
+
+/* Returns the next free send slot's payload buffer (MESSAGE_SIZE bytes) for
+ * the caller to fill in place. The slot stays reserved, and other senders
+ * on the socket wait, until k_send_commit(). */
+void *k_send_reserve(int sockfd, int flags) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (sock->remote_addr.sin_port == 0 || sock->backlog > 0) {
+        pthread_mutex_unlock(&sock->lock);
+        errno = ENOTBOUND;
+        return NULL;
+    }
+    if (wait_send_slot(sockfd, flags) == -1) {
+        return NULL;
+    }
+
+    sock->send_reserved = 1;
+    void *data = send_slots(sockfd)[SEND_SLOT(sock, sock->swnd.size + sock->send_buffer_size)].data;
+    pthread_mutex_unlock(&sock->lock);
+    return data;
+}
+
+/* Queues the reserved slot as a message of len bytes. */
+int k_send_commit(int sockfd, size_t len) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return -1;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (!sock->send_reserved || len > MESSAGE_SIZE) {
+        pthread_mutex_unlock(&sock->lock);
+        errno = EINVAL;
+        return -1;
+    }
+
+    send_slots(sockfd)[SEND_SLOT(sock, sock->swnd.size + sock->send_buffer_size)].length = len;
+    sock->send_buffer_size++;
+    sock->send_reserved = 0;
+    pthread_mutex_unlock(&sock->lock);
+
+    pthread_cond_broadcast(&sock->send_cond);
+    wake_socket(sockfd);
+    return 0;
+}
+
+/* Waits for a message at the head of the receive ring. Returns 0 with the
+ * socket lock still held, or -1 with errno set and the lock released. */
+static int wait_message(KTPSocket *sock, int flags) {
+    uint64_t deadline = sock->recv_timeout ? monotonic_ns() + sock->recv_timeout : 0;
+    while (sock->recv_buffer_size == 0) {
+        if ((flags & MSG_DONTWAIT) || wait_socket(sock, &sock->recv_cond, deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&sock->lock);
+            errno = ENOMESSAGE;
+            return -1;
+        }
+        if (sock->is_free) {
+            pthread_mutex_unlock(&sock->lock);
+            errno = EBADF;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the head message's slot to the free ring. Returns 1 if the peer
+ * must be sent a window update. Caller holds the socket lock. */
+static int release_message(int sockfd) {
+    KTPSocket *sock = ktp_socket(sockfd);
+    free_slot_push(sockfd, recv_ring(sockfd)[sock->recv_head]);
+    sock->recv_head = RECV_SLOT(sock, 1);
+    sock->recv_buffer_size--;
 
-pthread_mutex_unlock(&mutex);
-return len;
+    /* The peer was told the buffer is full; reopen its window right away. */
+    int window_update = sock->nospace_flag;
+    if (window_update) {
+        queue_ack(sockfd, sock->last_ack_seq, 0, 1);
+    }
+    return window_update;
 }
 
 ssize_t k_recvfrom(int sockfd, void *buf, size_t len, int flags, 
                    struct sockaddr *src_addr, socklen_t *addrlen) {
                    
-    if (sockfd < 0 || sockfd >= MAX_KTP_SOCKETS || shared_memory[sockfd].is_free) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
         errno = EBADF;
         return -1;
     }
 
-    pthread_mutex_lock(&mutex);
-    
-    if (shared_memory[sockfd].recv_buffer_size == 0) {
-        pthread_mutex_unlock(&mutex);
-        errno = ENOMESSAGE;
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (wait_message(sock, flags) == -1) {
         return -1;
     }
 
-    size_t copy_len = (len < MESSAGE_SIZE) ? len : MESSAGE_SIZE;
-    memcpy(buf, shared_memory[sockfd].recv_buffer[0], copy_len);
+    KTPRecvSlot *slot = &recv_slots(sockfd)[recv_ring(sockfd)[sock->recv_head]];
+    size_t copy_len = (len < slot->length) ? len : slot->length;
+    memcpy(buf, slot->data, copy_len);
     
     if (src_addr != NULL && addrlen != NULL) {
-        memcpy(src_addr, &shared_memory[sockfd].remote_addr, sizeof(struct sockaddr_in));
+        memcpy(src_addr, &sock->remote_addr, sizeof(struct sockaddr_in));
         *addrlen = sizeof(struct sockaddr_in);
     }
 
-    for (int i = 1; i < shared_memory[sockfd].recv_buffer_size; i++) {
-        memcpy(shared_memory[sockfd].recv_buffer[i - 1], shared_memory[sockfd].recv_buffer[i], MESSAGE_SIZE);
+    int window_update = release_message(sockfd);
+    pthread_mutex_unlock(&sock->lock);
+    if (window_update) {
+        wake_socket(sockfd);
     }
-    
-    shared_memory[sockfd].recv_buffer_size--;
-    shared_memory[sockfd].rwnd.size = BUFFER_SIZE - shared_memory[sockfd].recv_buffer_size;
-    
-    pthread_mutex_unlock(&mutex);
     return copy_len;
 }
 
+/* Returns the next message in place, without copying or consuming it; its
+ * length is stored in *len. The pointer stays valid until k_recv_release(). */
+const void *k_recv_peek(int sockfd, size_t *len, int flags) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (wait_message(sock, flags) == -1) {
+        return NULL;
+    }
+
+    KTPRecvSlot *slot = &recv_slots(sockfd)[recv_ring(sockfd)[sock->recv_head]];
+    *len = slot->length;
+    pthread_mutex_unlock(&sock->lock);
+    return slot->data;
+}
+
+/* Consumes the message last returned by k_recv_peek(). */
+int k_recv_release(int sockfd) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return -1;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (sock->recv_buffer_size == 0) {
+        pthread_mutex_unlock(&sock->lock);
+        errno = ENOMESSAGE;
+        return -1;
+    }
+    int window_update = release_message(sockfd);
+    pthread_mutex_unlock(&sock->lock);
+    if (window_update) {
+        wake_socket(sockfd);
+    }
+    return 0;
+}
+
+/* First message of a k_sendfile() transfer. It is acknowledged before any
+ * file data is sent, so it is always the first of the transfer's messages
+ * in the receive ring; chunk k of the file then carries sequence number
+ * seq_num + 1 + k, which places it in the file whatever order it arrives
+ * in. The transfer is complete once size bytes have been placed. */
+typedef struct {
+    char magic[4];
+    uint32_t chunk_size;
+    uint64_t size;
+} KTPFileHeader;
+
+#define KTP_FILE_MAGIC "KTPF"
+
+static void transfer_stats(KTPTransferStats *stats, uint64_t bytes, uint64_t start) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->bytes = bytes;
+    stats->seconds = (monotonic_ns() - start) / 1e9;
+    stats->bytes_per_sec = stats->seconds > 0 ? bytes / stats->seconds : 0;
+}
+
+/* Waits until every queued message has been acknowledged. */
+static int wait_drained(int sockfd) {
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    uint64_t deadline = sock->send_timeout ? monotonic_ns() + sock->send_timeout : 0;
+    while (sock->swnd.size + sock->send_buffer_size > 0 || sock->send_reserved) {
+        if (wait_socket(sock, &sock->send_cond, deadline) == ETIMEDOUT || sock->is_free) {
+            pthread_mutex_unlock(&sock->lock);
+            errno = sock->is_free ? EBADF : ENOSPACE;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&sock->lock);
+    return 0;
+}
+
+/* Sends a whole file, reading it through a read-only mapping straight into
+ * the send slots. Returns once the peer has acknowledged every byte. */
+ssize_t k_sendfile(int sockfd, const char *path, KTPTransferStats *stats) {
+    uint64_t start = monotonic_ns();
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    char *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    ssize_t result = -1;
+    KTPFileHeader *header = k_send_reserve(sockfd, 0);
+    if (header == NULL) {
+        goto out;
+    }
+    memcpy(header->magic, KTP_FILE_MAGIC, sizeof(header->magic));
+    header->chunk_size = MESSAGE_SIZE;
+    header->size = size;
+    if (k_send_commit(sockfd, sizeof(KTPFileHeader)) == -1 || wait_drained(sockfd) == -1) {
+        goto out;
+    }
+
+    for (size_t offset = 0; offset < size; offset += MESSAGE_SIZE) {
+        size_t len = size - offset < MESSAGE_SIZE ? size - offset : MESSAGE_SIZE;
+        char *data = k_send_reserve(sockfd, 0);
+        if (data == NULL) {
+            goto out;
+        }
+        memcpy(data, map + offset, len);
+        if (k_send_commit(sockfd, len) == -1) {
+            goto out;
+        }
+    }
+    if (wait_drained(sockfd) == -1) {
+        goto out;
+    }
+    result = size;
+    transfer_stats(stats, size, start);
+
+out:
+    if (map != NULL) {
+        munmap(map, size);
+    }
+    return result;
+}
+
+/* Takes the head message of the receive ring: copies out its payload
+ * pointer, length and sequence number, leaving it in place until released.
+ * Returns -1 with errno set if none arrives. */
+static int next_message(int sockfd, const char **data, size_t *len, uint32_t *seq_num) {
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (wait_message(sock, 0) == -1) {
+        return -1;
+    }
+    KTPRecvSlot *slot = &recv_slots(sockfd)[recv_ring(sockfd)[sock->recv_head]];
+    *data = slot->data;
+    *len = slot->length;
+    *seq_num = slot->seq_num;
+    pthread_mutex_unlock(&sock->lock);
+    return 0;
+}
+
+/* Receives a file sent with k_sendfile(), writing each chunk straight into a
+ * shared mapping of the destination file at the offset its sequence number
+ * gives. Returns the file size once every byte has arrived. */
+ssize_t k_recvfile(int sockfd, const char *path, KTPTransferStats *stats) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return -1;
+    }
+
+    const char *data;
+    size_t len;
+    uint32_t first_seq;
+    if (next_message(sockfd, &data, &len, &first_seq) == -1) {
+        return -1;
+    }
+    uint64_t start = monotonic_ns();
+    KTPFileHeader header;
+    if (len != sizeof(KTPFileHeader)) {
+        k_recv_release(sockfd);
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    k_recv_release(sockfd);
+    if (memcmp(header.magic, KTP_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.chunk_size != MESSAGE_SIZE) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t size = header.size;
+    char *map = NULL;
+    if (size > 0) {
+        if (ftruncate(fd, size) == -1 ||
+            (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    ssize_t result = -1;
+    size_t chunks = (size + MESSAGE_SIZE - 1) / MESSAGE_SIZE;
+    size_t received = 0;
+    uint32_t seq_num;
+    while (received < size) {
+        if (next_message(sockfd, &data, &len, &seq_num) == -1) {
+            goto out;
+        }
+        size_t chunk = (uint32_t)(seq_num - first_seq - 1);
+        size_t offset = chunk * MESSAGE_SIZE;
+        if (chunk >= chunks || len != (size - offset < MESSAGE_SIZE ? size - offset : MESSAGE_SIZE)) {
+            k_recv_release(sockfd);
+            errno = EPROTO;
+            goto out;
+        }
+        memcpy(map + offset, data, len);
+        k_recv_release(sockfd);
+        received += len;
+    }
+    result = size;
+    transfer_stats(stats, size, start);
+
+    /* The engine answers the peer's retransmissions of the last chunk even
+     * after k_close(). */
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    sock->linger = 1;
+    pthread_mutex_unlock(&sock->lock);
+
+out:
+    if (map != NULL) {
+        munmap(map, size);
+    }
+    return result;
+}
+
 int k_close(int sockfd) {
-    if (sockfd < 0 || sockfd >= MAX_KTP_SOCKETS || shared_memory[sockfd].is_free) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
         errno = EBADF;
         return -1;
     }
 
-    pthread_mutex_lock(&mutex);
-    close(shared_memory[sockfd].udp_socket);
-    shared_memory[sockfd].is_free = 1;
-    FD_CLR(shared_memory[sockfd].udp_socket, &read_fds);
-    
-    if (shared_memory[sockfd].udp_socket == max_fd) {
-        max_fd = 0;
-        for (int i = 0; i < MAX_KTP_SOCKETS; i++) {
-            if (!shared_memory[i].is_free && shared_memory[i].udp_socket > max_fd) {
-                max_fd = shared_memory[i].udp_socket;
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    int slots_shmid = sock->slots_shmid;
+    pthread_mutex_unlock(&sock->lock);
+
+    KTPCommand command = {0};
+    command.op = KTP_CMD_CLOSE;
+    command.sockfd = sockfd;
+    int result = engine_call(&command);
+
+    /* Drop this process's attachment of the closed socket's slots. It must
+     * outlive the close: when the engine runs in this process (ktp_bench)
+     * the attachment is shared with it, and stays in use in TIME_WAIT. */
+    char *slots = NULL;
+    pthread_mutex_lock(&sock->lock);
+    if (SLOT_CACHE(sockfd).shmid == slots_shmid &&
+        !(sock->time_wait && ktp_table->engine_pid == getpid())) {
+        slots = SLOT_CACHE(sockfd).base;
+        SLOT_CACHE(sockfd).base = NULL;
+        SLOT_CACHE(sockfd).shmid = -1;
+    }
+    pthread_mutex_unlock(&sock->lock);
+    if (slots != NULL) {
+        shmdt(slots);
+    }
+    return result == -1 ? -1 : 0;
+}
+
+/* Makes a bound socket accept connections: from then on every peer that
+ * sends it data gets a socket of its own, up to backlog of them waiting for
+ * k_accept(). The listener itself no longer sends or receives. */
+int k_listen(int sockfd, int backlog) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return -1;
+    }
+    if (backlog < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    /* A listener reads from any peer, which rules out a connected port and
+     * coalesced reads. */
+    if (sock->reuseport || (sock->offload & KTP_OFFLOAD_GRO)) {
+        pthread_mutex_unlock(&sock->lock);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (sock->local_addr.sin_family == 0 || sock->listener >= 0) {
+        pthread_mutex_unlock(&sock->lock);
+        errno = ENOTBOUND;
+        return -1;
+    }
+    sock->backlog = backlog;
+    pthread_mutex_unlock(&sock->lock);
+    return 0;
+}
+
+/* Takes the oldest connection off the listener's accept queue, waiting for
+ * one up to the receive timeout, and returns its socket. The connection is
+ * closed along with the listener. */
+int k_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return -1;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    pthread_mutex_lock(&sock->lock);
+    if (sock->backlog == 0) {
+        pthread_mutex_unlock(&sock->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t deadline = sock->recv_timeout ? monotonic_ns() + sock->recv_timeout : 0;
+    while (sock->accept_head == -1) {
+        if (wait_socket(sock, &sock->recv_cond, deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&sock->lock);
+            errno = ENOMESSAGE;
+            return -1;
+        }
+        if (sock->is_free) {
+            pthread_mutex_unlock(&sock->lock);
+            errno = EBADF;
+            return -1;
+        }
+    }
+    int c = sock->accept_head;
+    KTPSocket *conn = ktp_socket(c);
+    sock->accept_head = conn->next_accept;
+    if (sock->accept_head == -1) {
+        sock->accept_tail = -1;
+    }
+    sock->accept_count--;
+    conn->next_accept = -1;
+    struct sockaddr_in peer = conn->remote_addr;
+    pthread_mutex_unlock(&sock->lock);
+
+    if (addr != NULL && addrlen != NULL) {
+        socklen_t len = *addrlen < sizeof(peer) ? *addrlen : sizeof(peer);
+        memcpy(addr, &peer, len);
+        *addrlen = sizeof(peer);
+    }
+    return c;
+}
+
+int k_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return -1;
+    }
+    if (level != SOL_KTP || optval == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    switch (optname) {
+    case KTP_RCVTIMEO:
+    case KTP_SNDTIMEO: {
+        if (optlen < sizeof(struct timeval)) {
+            errno = EINVAL;
+            return -1;
+        }
+        const struct timeval *tv = optval;
+        uint64_t timeout = (uint64_t)tv->tv_sec * 1000000000ULL + (uint64_t)tv->tv_usec * 1000ULL;
+        pthread_mutex_lock(&sock->lock);
+        if (optname == KTP_RCVTIMEO) {
+            sock->recv_timeout = timeout;
+        } else {
+            sock->send_timeout = timeout;
+        }
+        pthread_mutex_unlock(&sock->lock);
+        return 0;
+    }
+    case KTP_SNDWND:
+    case KTP_RCVWND: {
+        if (optlen < sizeof(int) || *(const int *)optval < 1 || *(const int *)optval > KTP_MAX_WINDOW) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        int snd_wnd = (optname == KTP_SNDWND) ? *(const int *)optval : sock->snd_wnd;
+        int rcv_wnd = (optname == KTP_RCVWND) ? *(const int *)optval : sock->rcv_wnd;
+        pthread_mutex_unlock(&sock->lock);
+
+        char *slots;
+        int slots_shmid = create_slots(snd_wnd, rcv_wnd, &slots);
+        if (slots_shmid == -1) {
+            return -1;
+        }
+
+        /* Slots are only resized while nothing is queued, in flight or
+         * waiting to be reassembled, so no message state has to move, and
+         * no syscall has them pinned. */
+        pthread_mutex_lock(&sock->lock);
+        wait_unpinned(sock);
+        int busy = sock->swnd.size > 0 || sock->send_buffer_size > 0 || sock->send_reserved ||
+                   sock->recv_buffer_size > 0 || sock->rwnd.max_seq != sock->rwnd.next_seq;
+        if (!busy) {
+            slots = install_slots(sockfd, slots_shmid, slots, snd_wnd, rcv_wnd);
+            sock->swnd.head = 0;
+        }
+        pthread_mutex_unlock(&sock->lock);
+        shmdt(slots);
+        if (busy) {
+            errno = EBUSY;
+            return -1;
+        }
+        return 0;
+    }
+    case KTP_CONGESTION: {
+        if (optlen < sizeof(int) || *(const int *)optval < 0 || *(const int *)optval >= CC_ALGORITHMS) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        cc_init(sock, *(const int *)optval);
+        pthread_mutex_unlock(&sock->lock);
+        wake_socket(sockfd);
+        return 0;
+    }
+    case KTP_LOSS: {
+        if (optlen < sizeof(float) || !(*(const float *)optval >= 0 && *(const float *)optval <= 1)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        sock->impair.loss = *(const float *)optval;
+        pthread_mutex_unlock(&sock->lock);
+        return 0;
+    }
+    case KTP_DELACK: {
+        const KTPDelayedAck *delack = optval;
+        if (optlen < sizeof(KTPDelayedAck) || delack->packets < 1 || delack->packets > KTP_MAX_WINDOW ||
+            delack->timeout_us > RTO_MIN_MS * 1000) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        sock->delack = *delack;
+        pthread_mutex_unlock(&sock->lock);
+        return 0;
+    }
+    case KTP_REUSEPORT: {
+        if (optlen < sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        sock->reuseport = *(const int *)optval != 0;
+        pthread_mutex_unlock(&sock->lock);
+        return 0;
+    }
+    case KTP_FEC: {
+        if (optlen < sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        int k = *(const int *)optval;
+        if (k != 0 && k != KTP_FEC_AUTO && (k < 2 || k > KTP_FEC_MAX_K)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        sock->fec = k;
+        pthread_mutex_unlock(&sock->lock);
+        return 0;
+    }
+    case KTP_OFFLOAD: {
+        if (optlen < sizeof(int) || (*(const int *)optval & ~(KTP_OFFLOAD_GSO | KTP_OFFLOAD_GRO))) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* Applied by k_bind; a bound socket's UDP options stay as they are. */
+        pthread_mutex_lock(&sock->lock);
+        if (sock->local_addr.sin_family != 0) {
+            pthread_mutex_unlock(&sock->lock);
+            errno = EISCONN;
+            return -1;
+        }
+        sock->offload = *(const int *)optval;
+        pthread_mutex_unlock(&sock->lock);
+        return 0;
+    }
+    case KTP_IMPAIR: {
+        if (optlen < sizeof(KTPImpairment)) {
+            errno = EINVAL;
+            return -1;
+        }
+        KTPImpairment impair = *(const KTPImpairment *)optval;
+        float probabilities[] = {impair.loss, impair.ge_p, impair.ge_r, impair.ge_loss_good,
+                                 impair.ge_loss_bad, impair.reorder, impair.duplicate};
+        for (size_t k = 0; k < sizeof(probabilities) / sizeof(probabilities[0]); k++) {
+            if (!(probabilities[k] >= 0 && probabilities[k] <= 1)) {
+                errno = EINVAL;
+                return -1;
             }
         }
+        if (impair.limit == 0) {
+            impair.limit = KTP_IMPAIR_LIMIT;
+        }
+        pthread_mutex_lock(&sock->lock);
+        if (impair.seed != 0) {
+            impair_seed(sock, impair.seed);
+        } else {
+            impair.seed = sock->impair.seed;
+        }
+        sock->impair = impair;
+        pthread_mutex_unlock(&sock->lock);
+        return 0;
+    }
+    default:
+        errno = ENOPROTOOPT;
+        return -1;
     }
-    
-    pthread_mutex_unlock(&mutex);
-    return 0;
 }
 
-int dropMessage(float p) {
-    float random = (float)rand() / RAND_MAX;
-    return random < p ? 1 : 0;
-}
\ No newline at end of file
+int k_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    if (sockfd < 0 || sockfd >= ktp_table->capacity || ktp_socket(sockfd)->is_free) {
+        errno = EBADF;
+        return -1;
+    }
+    if (level != SOL_KTP || optval == NULL || optlen == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    KTPSocket *sock = ktp_socket(sockfd);
+    switch (optname) {
+    case KTP_SNDWND:
+    case KTP_RCVWND:
+    case KTP_CONGESTION:
+    case KTP_REUSEPORT:
+    case KTP_OFFLOAD:
+    case KTP_FEC: {
+        if (*optlen < sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        if (optname == KTP_SNDWND) {
+            *(int *)optval = sock->snd_wnd;
+        } else if (optname == KTP_RCVWND) {
+            *(int *)optval = sock->rcv_wnd;
+        } else if (optname == KTP_REUSEPORT) {
+            *(int *)optval = sock->reuseport;
+        } else if (optname == KTP_OFFLOAD) {
+            *(int *)optval = sock->offload;
+        } else if (optname == KTP_FEC) {
+            *(int *)optval = sock->fec;
+        } else {
+            *(int *)optval = sock->cc.algorithm;
+        }
+        pthread_mutex_unlock(&sock->lock);
+        *optlen = sizeof(int);
+        return 0;
+    }
+    case KTP_CC_INFO: {
+        if (*optlen < sizeof(KTPCongestionInfo)) {
+            errno = EINVAL;
+            return -1;
+        }
+        KTPCongestionInfo *info = optval;
+        pthread_mutex_lock(&sock->lock);
+        uint64_t interval = pacing_interval(sock);
+        info->algorithm = sock->cc.algorithm;
+        info->cwnd = sock->cc.cwnd;
+        info->ssthresh = sock->cc.ssthresh;
+        info->in_flight = sock->swnd.size;
+        info->srtt_us = sock->rtt.srtt / 1000;
+        info->min_rtt_us = sock->cc.min_rtt / 1000;
+        info->pacing_rate = interval ? 1000000000ULL / interval : 0;
+        info->packets_sent = sock->cc.packets_sent;
+        info->retransmits = sock->cc.retransmits;
+        info->fast_retransmits = sock->cc.fast_retransmits;
+        info->timeouts = sock->cc.timeouts;
+        info->cwnd_reductions = sock->cc.cwnd_reductions;
+        info->paced_waits = sock->cc.paced_waits;
+        pthread_mutex_unlock(&sock->lock);
+        *optlen = sizeof(KTPCongestionInfo);
+        return 0;
+    }
+    case KTP_LOSS: {
+        if (*optlen < sizeof(float)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        *(float *)optval = sock->impair.loss;
+        pthread_mutex_unlock(&sock->lock);
+        *optlen = sizeof(float);
+        return 0;
+    }
+    case KTP_DELACK: {
+        if (*optlen < sizeof(KTPDelayedAck)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        *(KTPDelayedAck *)optval = sock->delack;
+        pthread_mutex_unlock(&sock->lock);
+        *optlen = sizeof(KTPDelayedAck);
+        return 0;
+    }
+    case KTP_IMPAIR: {
+        if (*optlen < sizeof(KTPImpairment)) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&sock->lock);
+        *(KTPImpairment *)optval = sock->impair;
+        pthread_mutex_unlock(&sock->lock);
+        *optlen = sizeof(KTPImpairment);
+        return 0;
+    }
+    case KTP_STATS: {
+        if (*optlen < sizeof(KTPStats)) {
+            errno = EINVAL;
+            return -1;
+        }
+        const uint64_t *counters = (const uint64_t *)&sock->stats;
+        uint64_t *out = optval;
+        for (size_t k = 0; k < sizeof(KTPStats) / sizeof(uint64_t); k++) {
+            out[k] = __atomic_load_n(&counters[k], __ATOMIC_RELAXED);
+        }
+        *optlen = sizeof(KTPStats);
+        return 0;
+    }
+    default:
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+}
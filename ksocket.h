@@ -11,58 +11,432 @@
 #include <sys/shm.h>
 #include <sys/ipc.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <time.h>
+#include <stdint.h>
 
 #define SOCK_KTP 10
-#define MAX_KTP_SOCKETS 100
+#define KTP_CHUNK_SOCKETS 64
+#define KTP_MAX_CHUNKS 1024
+#define MAX_KTP_SOCKETS (KTP_CHUNK_SOCKETS * KTP_MAX_CHUNKS)
+#define KTP_EPOLL_EVENTS 256
+#define KTP_SHM_KEY 0x4b545000
+#define KTP_MAX_CLIENTS 64
+#define KTP_RING_ENTRIES 16
+#define KTP_MAX_WORKERS 64
 #define MESSAGE_SIZE 512
 #define BUFFER_SIZE 10
 #define ENOSPACE 1
 #define ENOTBOUND 2
 #define ENOMESSAGE 3
+#define SOL_KTP 280
+#define KTP_RCVTIMEO 1
+#define KTP_SNDTIMEO 2
 #define T 5 
 #define P 0.05
+#define RTO_INIT_MS 1000
+#define RTO_MIN_MS 50
+#define RTO_MAX_MS (T * 1000)
+#define KTP_TIME_WAIT_MS (RTO_MAX_MS + RTO_MIN_MS)
 
+#define KTP_SNDWND 3
+#define KTP_RCVWND 4
+#define KTP_MAX_WINDOW (MESSAGE_SIZE * 8)
+
+#define SEQ_LT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_GEQ(a, b) (!SEQ_LT(a, b))
+
+#define DUPACK_THRESHOLD 3
+#define KTP_BATCH 32
+
+#define KTP_CONGESTION 5
+#define KTP_CC_INFO 6
+#define KTP_STATS 7
+#define KTP_LOSS 8
+#define KTP_IMPAIR 9
+#define KTP_REUSEPORT 10
+#define KTP_DELACK 11
+#define KTP_DELACK_PACKETS 2
+#define KTP_DELACK_US 1000
+#define KTP_OFFLOAD 12
+#define KTP_OFFLOAD_GSO 1
+#define KTP_OFFLOAD_GRO 2
+#define KTP_GSO_SEGMENTS 64
+#define KTP_GRO_BATCH 8
+#define KTP_FEC 13
+#define KTP_FEC_AUTO (-1)
+#define KTP_FEC_MAX_K 16
+#define KTP_FEC_PENDING 4
+#define KTP_FEC_EPOCH 256
+#define KTP_PEER_BUCKETS 64
+#define KTP_IO_EPOLL 0
+#define KTP_IO_URING 1
+#define KTP_URING_ENTRIES 1024
+#define KTP_URING_BUFFERS 1024
+#define KTP_URING_ARENA (1 << 20)
+#define KTP_FLAG_DATA 1
+#define KTP_FLAG_ACK 2
+#define KTP_FLAG_PARITY 4
+#define KTP_TRACE_EVENTS 16384
+#define KTP_TRACE_OFF 0
+#define KTP_TRACE_LOSS 1
+#define KTP_TRACE_ALL 2
+#define KTP_EV_SEND 1
+#define KTP_EV_RECV 2
+#define KTP_EV_ACK 3
+#define KTP_EV_RETRANSMIT 4
+#define KTP_EV_FAST_RETRANSMIT 5
+#define KTP_EV_DUPACKS 6
+#define KTP_EV_TIMEOUT 7
+#define KTP_EV_DUPLICATE 8
+#define KTP_EV_DROP 9
+#define KTP_EV_QUEUE_FULL 10
+#define KTP_EV_MALFORMED 11
+#define KTP_EV_NOSPACE 12
+#define KTP_EV_WINDOW_UPDATE 13
+#define KTP_EV_UNKNOWN_ACK 14
+#define KTP_EV_PARITY 15
+#define KTP_EV_FEC_RECOVER 16
+#define KTP_IMPAIR_LIMIT 1000
+#define KTP_CC_NEWRENO 0
+#define KTP_CC_DELAY 1
+#define KTP_INIT_CWND 10
+#define KTP_MIN_CWND 2
+#define PACING_SLACK_NS 250000ULL
+#define KTP_RTT_BUCKETS 20
+
+#define KTP_CMD_SOCKET 1
+#define KTP_CMD_BIND 2
+#define KTP_CMD_CLOSE 3
+
+/* flags says what a packet carries: KTP_FLAG_DATA a message (seq_num),
+ * KTP_FLAG_ACK acknowledgment information (cum_ack, rwnd_size, ack_seq,
+ * is_nospace), or both when an ACK rides on data. A pure ACK carries a
+ * SACK bitmap as its payload: bit k of the bitmap (byte k / 8, bit k % 8)
+ * is set when cum_ack + k has been received. KTP_FLAG_PARITY marks a
+ * parity packet for the rwnd_size messages starting at seq_num: its payload
+ * is the XOR of theirs, each zero-padded to the longest, and ack_seq the
+ * XOR of their lengths. On the wire the header is these 20 bytes in this
+ * order, without padding, each field in network byte order. */
 typedef struct {
-    unsigned char seq_num;
-    unsigned char rwnd_size;
-    unsigned char is_ack;
+    uint32_t seq_num;
+    uint32_t cum_ack;
+    uint32_t rwnd_size;
+    uint32_t ack_seq;
+    uint16_t payload_len;
+    unsigned char flags;
     unsigned char is_nospace;
 } KTPHeader;
 
+_Static_assert(sizeof(KTPHeader) == 20, "KTPHeader is 20 bytes on the wire");
+
+typedef struct {
+    uint32_t seq_num;
+    uint16_t length;
+    unsigned char acked;
+    unsigned char retransmitted;
+    unsigned char pinned;
+    uint64_t send_time;
+    char data[MESSAGE_SIZE];
+} KTPSendSlot;
+
+typedef struct {
+    uint32_t seq_num;
+    uint16_t length;
+    char data[MESSAGE_SIZE];
+} KTPRecvSlot;
+
+/* Returned by k_getsockopt(KTP_CC_INFO). */
+typedef struct {
+    int algorithm;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t in_flight;
+    uint64_t srtt_us;
+    uint64_t min_rtt_us;
+    uint64_t pacing_rate;
+    uint64_t packets_sent;
+    uint64_t retransmits;
+    uint64_t fast_retransmits;
+    uint64_t timeouts;
+    uint64_t cwnd_reductions;
+    uint64_t paced_waits;
+} KTPCongestionInfo;
+
+/* Per-socket counters in the socket table. The engine bumps them with
+ * relaxed atomics and readers (k_getsockopt(KTP_STATS), ktpstat) load them
+ * without the socket lock, so a snapshot is not exactly consistent across
+ * fields. Data counters exclude headers; rtt_hist[k] counts RTT samples of
+ * 2^k to 2^(k+1) - 1 us, the last bucket everything slower. */
+typedef struct {
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t retransmits;
+    uint64_t acks_sent;
+    uint64_t packets_received;
+    uint64_t bytes_received;
+    uint64_t duplicates;
+    uint64_t acks_received;
+    uint64_t acks_piggybacked;
+    uint64_t drops;
+    uint64_t nospace_sent;
+    uint64_t nospace_received;
+    uint64_t parity_sent;
+    uint64_t fec_recovered;
+    uint64_t stall_ns;
+    uint64_t rtt_hist[KTP_RTT_BUCKETS];
+} KTPStats;
+
+/* Network impairments applied to a socket's outgoing packets, set with
+ * k_setsockopt(KTP_IMPAIR) or the KTP_IMPAIR environment variable. Loss is
+ * Bernoulli (loss) and Gilbert-Elliott (ge_p moves good -> bad, ge_r bad ->
+ * good, each state losing ge_loss_good / ge_loss_bad); both apply. Packets
+ * are delayed by delay_us +- jitter_us, and with probability reorder one
+ * skips the delay, overtaking those still held. rate_bps caps the rate the
+ * packets leave at; at most limit of them wait in the engine. A nonzero
+ * seed restarts the socket's random sequence. */
+typedef struct {
+    float loss;
+    float ge_p;
+    float ge_r;
+    float ge_loss_good;
+    float ge_loss_bad;
+    uint32_t delay_us;
+    uint32_t jitter_us;
+    float reorder;
+    float duplicate;
+    uint64_t rate_bps;
+    uint32_t limit;
+    uint64_t seed;
+} KTPImpairment;
+
+/* Delayed ACKs, set with k_setsockopt(KTP_DELACK): in-order data is
+ * acknowledged once packets messages have arrived or timeout_us after the
+ * first unacknowledged one, whichever comes first. packets = 1 acknowledges
+ * every message at once. */
+typedef struct {
+    int packets;
+    uint32_t timeout_us;
+} KTPDelayedAck;
+
+/* Filled in by k_sendfile() and k_recvfile(). */
+typedef struct {
+    uint64_t bytes;
+    double seconds;
+    double bytes_per_sec;
+} KTPTransferStats;
+
+/* Slot storage lives in a per-socket shm segment (slots_shmid) sized to the
+ * socket's windows: snd_wnd KTPSendSlots, rcv_wnd KTPRecvSlots, the
+ * received-sequence bitmap of the receive window, then three arrays of
+ * rcv_wnd uint16_t receive slot numbers: rings of messages awaiting
+ * delivery (recv_head, recv_buffer_size) and of free slots (recv_free_head,
+ * recv_free_count), and the reorder map of messages that arrived ahead of a
+ * gap, indexed by sequence number. */
 typedef struct {
+    int in_use;
     int is_free;
+    int next_free;
+    int prev_active;
+    int next_active;
+    int worker;
+    int reuseport;
+    int offload;
+    int fec;
+    int listener;
+    int backlog;
+    int accept_head;
+    int accept_tail;
+    int accept_count;
+    int next_accept;
+    int next_peer;
+    pthread_mutex_t lock;
+    pthread_cond_t recv_cond;
+    pthread_cond_t send_cond;
+    uint64_t recv_timeout;
+    uint64_t send_timeout;
     pid_t pid;
     int udp_socket;
     struct sockaddr_in local_addr;
     struct sockaddr_in remote_addr;
-    char send_buffer[BUFFER_SIZE][MESSAGE_SIZE];
-    char recv_buffer[BUFFER_SIZE][MESSAGE_SIZE];
+    int slots_shmid;
+    /* Syscalls the engine has in progress on the socket without its lock:
+     * the slot segment is not resized or detached, nor the UDP socket
+     * closed, until pins is back to 0, and a send slot is not reused while
+     * it is pinned. pin_wait asks for send_cond to be broadcast then. */
+    int pins;
+    int pin_wait;
+    int snd_wnd;
+    int rcv_wnd;
     int send_buffer_size;
+    int send_reserved;
+    int recv_head;
     int recv_buffer_size;
+    int recv_free_head;
+    int recv_free_count;
     struct {
+        int head;
         int size;
-        unsigned char seq_nums[BUFFER_SIZE];
-        time_t send_times[BUFFER_SIZE];
+        uint32_t cum_ack;
+        int dup_acks;
+        int fast_retransmit;
     } swnd;
     struct {
-        int size;
-        unsigned char seq_nums[BUFFER_SIZE];
+        uint64_t srtt;
+        uint64_t rttvar;
+        uint64_t rto;
+        int backoff;
+    } rtt;
+    struct {
+        uint32_t size;
+        uint32_t next_seq;
+        uint32_t max_seq;
     } rwnd;
-    unsigned char last_ack_seq;
+    struct {
+        int algorithm;
+        uint32_t cwnd;
+        uint32_t ssthresh;
+        uint32_t cwnd_cnt;
+        int in_recovery;
+        uint32_t recover;
+        uint32_t epoch_seq;
+        uint64_t epoch_rtt;
+        uint64_t min_rtt;
+        uint64_t next_send;
+        uint64_t packets_sent;
+        uint64_t retransmits;
+        uint64_t fast_retransmits;
+        uint64_t timeouts;
+        uint64_t cwnd_reductions;
+        uint64_t paced_waits;
+    } cc;
+    KTPStats stats;
+    uint64_t stall_start;
+    uint64_t window_probe;
+    KTPImpairment impair;
+    uint64_t impair_rng;
+    int impair_bad;
+    int impair_queued;
+    uint64_t impair_link_free;
+    uint32_t last_ack_seq;
+    uint64_t last_data_time;
+    /* Set by k_recvfile(): closing the socket puts it in TIME_WAIT
+     * (time_wait) instead, where the engine keeps acknowledging the peer's
+     * retransmissions until no data has come for KTP_TIME_WAIT_MS. */
+    int linger;
+    int time_wait;
     int nospace_flag;
-    
-    unsigned char received_seq[256];  
-    unsigned char next_seq_num;       
+    int ack_pending;
+    uint32_t ack_seq;
+    int ack_nospace;
+    int ack_held;
+    uint64_t ack_deadline;
+    KTPDelayedAck delack;
+    uint32_t next_seq_num;       
 } KTPSocket;
 
+/* A request from an application to initksocket; the engine fills in result
+ * and error and sends it back as the reply. */
+typedef struct {
+    int op;
+    int sockfd;
+    int domain;
+    int protocol;
+    struct sockaddr_in local_addr;
+    struct sockaddr_in remote_addr;
+    int result;
+    int error;
+} KTPCommand;
+
+/* Single-producer single-consumer ring: head is written only by the
+ * producer and tail only by the consumer; both count up freely. */
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    KTPCommand entries[KTP_RING_ENTRIES];
+} KTPRing;
+
+/* An application process's connection to initksocket, claimed by setting
+ * pid. reply_futex is bumped whenever a reply is pushed. */
+typedef struct {
+    pid_t pid;
+    uint32_t reply_futex;
+    KTPRing requests;
+    KTPRing replies;
+} KTPChannel;
+
+/* An engine worker as applications see it: they bump work and, if the
+ * worker is sleeping, ring its doorbell, a UDP socket on loopback. sockets
+ * counts the sockets it owns; cpu is the CPU it is pinned to, or -1. */
+typedef struct {
+    uint32_t work;
+    int sleeping;
+    in_port_t doorbell_port;
+    int sockets;
+    int cpu;
+} KTPWorker;
+
+/* One protocol event. seq and window depend on type: the packet's sequence
+ * number (cum_ack for ACK events) and the send window, receive buffer or
+ * cwnd it left behind. */
+typedef struct {
+    uint64_t time_ns;
+    int32_t sockfd;
+    uint16_t type;
+    uint16_t worker;
+    uint32_t seq;
+    uint32_t window;
+} KTPTraceEvent;
+
+/* A worker's trace ring, written only by that worker. head counts the
+ * events ever written; event n is events[n % KTP_TRACE_EVENTS] until it is
+ * overwritten KTP_TRACE_EVENTS events later. */
+typedef struct {
+    uint64_t head;
+    KTPTraceEvent events[KTP_TRACE_EVENTS];
+} KTPTraceRing;
+
+/* Header of the shared socket table. Sockets live in chunk segments of
+ * KTP_CHUNK_SOCKETS each, added on demand up to KTP_MAX_CHUNKS; ids index
+ * across chunks. Free sockets are chained through next_free and open ones
+ * through prev_active/next_active, all under lock. The workers' trace rings
+ * fill segment trace_shmid; trace_level (KTP_TRACE_*) selects which events
+ * they record and may be changed at any time. */
+typedef struct {
+    pthread_mutex_t lock;
+    int capacity;
+    int nchunks;
+    int free_head;
+    int active_head;
+    int active_count;
+    int chunk_shmid[KTP_MAX_CHUNKS];
+    pid_t engine_pid;
+    uint32_t command_futex;
+    int nworkers;
+    int io_backend;
+    KTPWorker workers[KTP_MAX_WORKERS];
+    int trace_level;
+    int trace_shmid;
+    KTPChannel channels[KTP_MAX_CLIENTS];
+} KTPTable;
+
 int k_socket(int domain, int type, int protocol);
 int k_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen, const struct sockaddr *remote_addr, socklen_t remote_addrlen);
 ssize_t k_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t k_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
 int k_close(int sockfd);
-int dropMessage(float p);
+int k_listen(int sockfd, int backlog);
+int k_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+void *k_send_reserve(int sockfd, int flags);
+int k_send_commit(int sockfd, size_t len);
+const void *k_recv_peek(int sockfd, size_t *len, int flags);
+int k_recv_release(int sockfd);
+ssize_t k_sendfile(int sockfd, const char *path, KTPTransferStats *stats);
+ssize_t k_recvfile(int sockfd, const char *path, KTPTransferStats *stats);
+int k_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+int k_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen);
+int k_impair_parse(const char *spec, KTPImpairment *impair);
 
 int init_shared_memory();
+int init_engine();
 #endif 
\ No newline at end of file
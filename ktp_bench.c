@@ -0,0 +1,347 @@
+#include "ksocket.h"
+#include <errno.h>
+#include <sys/resource.h>
+
+/* Loopback benchmark. Runs its own protocol engine on a private socket
+ * table, then for every combination of message size, window, loss rate and
+ * socket count moves messages through that many sender/receiver socket
+ * pairs at once. Prints one JSON object per combination on stdout; the
+ * engine's own logging is discarded. */
+
+extern KTPTable *ktp_table;
+
+void *worker_thread(void *arg);
+void *command_thread(void *arg);
+
+#define BENCH_PORT 7000
+#define MAX_LIST 16
+
+typedef struct {
+    int values[MAX_LIST];
+    int count;
+} IntList;
+
+typedef struct {
+    float values[MAX_LIST];
+    int count;
+} FloatList;
+
+typedef struct {
+    int sender;
+    int receiver;
+    struct sockaddr_in remote;
+    int msg_size;
+    int messages;
+    uint64_t *latencies;
+    int received;
+    int corrupt;
+    int failed;
+} Pair;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+           (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void parse_ints(const char *arg, IntList *list) {
+    char *copy = strdup(arg);
+    list->count = 0;
+    for (char *tok = strtok(copy, ","); tok != NULL && list->count < MAX_LIST; tok = strtok(NULL, ",")) {
+        list->values[list->count++] = atoi(tok);
+    }
+    free(copy);
+}
+
+static void parse_floats(const char *arg, FloatList *list) {
+    char *copy = strdup(arg);
+    list->count = 0;
+    for (char *tok = strtok(copy, ","); tok != NULL && list->count < MAX_LIST; tok = strtok(NULL, ",")) {
+        list->values[list->count++] = atof(tok);
+    }
+    free(copy);
+}
+
+static struct sockaddr_in loopback(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+static int fec = 0;
+/* With -t the senders switch KTP_FEC between off and -f's setting every
+ * fec_toggle messages. */
+static int fec_toggle = 0;
+/* With -a the receivers are the connections of one listener on
+ * BENCH_PORT - 1, each taken by its receiving thread with k_accept(). */
+static int accept_mode = 0;
+static int listener = -1;
+
+static int open_socket(int local_port, int remote_port, int window, float loss) {
+    int sockfd = k_socket(AF_INET, SOCK_KTP, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    struct sockaddr_in local = loopback(local_port), remote = loopback(remote_port);
+    struct timeval timeout = {30, 0};
+    if (k_bind(sockfd, (struct sockaddr *)&local, sizeof(local),
+               (struct sockaddr *)&remote, sizeof(remote)) < 0 ||
+        k_setsockopt(sockfd, SOL_KTP, KTP_SNDWND, &window, sizeof(window)) < 0 ||
+        k_setsockopt(sockfd, SOL_KTP, KTP_RCVWND, &window, sizeof(window)) < 0 ||
+        k_setsockopt(sockfd, SOL_KTP, KTP_LOSS, &loss, sizeof(loss)) < 0 ||
+        k_setsockopt(sockfd, SOL_KTP, KTP_FEC, &fec, sizeof(fec)) < 0 ||
+        k_setsockopt(sockfd, SOL_KTP, KTP_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        k_setsockopt(sockfd, SOL_KTP, KTP_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        k_close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/* The bytes of message n after its timestamp, which the receiver checks. */
+static void fill_message(char *buf, int n, int msg_size) {
+    for (int b = sizeof(uint64_t); b < msg_size; b++) {
+        buf[b] = (char)(n * 7 + b);
+    }
+}
+
+/* Each message starts with its send time, so the receiver can measure
+ * delivery latency against the same clock. */
+static void *send_messages(void *arg) {
+    Pair *pair = arg;
+    char buf[MESSAGE_SIZE];
+    for (int n = 0; n < pair->messages; n++) {
+        if (fec_toggle > 0 && n > 0 && n % fec_toggle == 0) {
+            int k = (n / fec_toggle) % 2 ? 0 : fec;
+            k_setsockopt(pair->sender, SOL_KTP, KTP_FEC, &k, sizeof(k));
+        }
+        fill_message(buf, n, pair->msg_size);
+        uint64_t sent = now_ns();
+        memcpy(buf, &sent, sizeof(sent));
+        if (k_sendto(pair->sender, buf, pair->msg_size, 0,
+                     (struct sockaddr *)&pair->remote, sizeof(pair->remote)) < 0) {
+            pair->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *receive_messages(void *arg) {
+    Pair *pair = arg;
+    char buf[MESSAGE_SIZE], expected[MESSAGE_SIZE];
+    if (pair->receiver < 0 && (pair->receiver = k_accept(listener, NULL, NULL)) < 0) {
+        pair->failed = 1;
+        return NULL;
+    }
+    while (pair->received < pair->messages) {
+        ssize_t len = k_recvfrom(pair->receiver, buf, sizeof(buf), 0, NULL, NULL);
+        if (len < (ssize_t)sizeof(uint64_t)) {
+            pair->failed = 1;
+            break;
+        }
+        fill_message(expected, pair->received, pair->msg_size);
+        if (len != pair->msg_size ||
+            memcmp(buf + sizeof(uint64_t), expected + sizeof(uint64_t), len - sizeof(uint64_t)) != 0) {
+            pair->corrupt++;
+        }
+        uint64_t sent;
+        memcpy(&sent, buf, sizeof(sent));
+        pair->latencies[pair->received++] = now_ns() - sent;
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, int count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    int k = (int)(p * (count - 1));
+    return sorted[k] / 1000.0;
+}
+
+static void run(FILE *out, int msg_size, int window, float loss, int sockets, int messages) {
+    Pair *pairs = calloc(sockets, sizeof(Pair));
+    pthread_t *threads = calloc(2 * sockets, sizeof(pthread_t));
+    uint64_t *latencies = calloc((size_t)sockets * messages, sizeof(uint64_t));
+    if (pairs == NULL || threads == NULL || latencies == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    if (accept_mode) {
+        listener = open_socket(BENCH_PORT - 1, 0, window, loss);
+        if (listener < 0 || k_listen(listener, sockets) < 0) {
+            perror("ktp_bench: opening listener");
+            exit(1);
+        }
+    }
+    int opened = 0;
+    for (int k = 0; k < sockets; k++) {
+        int port = BENCH_PORT + 2 * k;
+        int remote = accept_mode ? BENCH_PORT - 1 : port;
+        pairs[k].receiver = accept_mode ? -1 : open_socket(port, port + 1, window, loss);
+        pairs[k].sender = !accept_mode && pairs[k].receiver < 0 ? -1 : open_socket(port + 1, remote, window, loss);
+        if (pairs[k].sender < 0) {
+            if (pairs[k].receiver >= 0) {
+                k_close(pairs[k].receiver);
+            }
+            perror("ktp_bench: opening sockets");
+            break;
+        }
+        pairs[k].remote = loopback(remote);
+        pairs[k].msg_size = msg_size;
+        pairs[k].messages = messages;
+        pairs[k].latencies = latencies + (size_t)k * messages;
+        opened++;
+    }
+
+    uint64_t cpu_start = cpu_ns();
+    uint64_t start = now_ns();
+    for (int k = 0; k < opened; k++) {
+        pthread_create(&threads[2 * k], NULL, receive_messages, &pairs[k]);
+        pthread_create(&threads[2 * k + 1], NULL, send_messages, &pairs[k]);
+    }
+    for (int k = 0; k < 2 * opened; k++) {
+        pthread_join(threads[k], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    uint64_t cpu = cpu_ns() - cpu_start;
+
+    uint64_t delivered = 0, packets = 0, retransmits = 0, recovered = 0, corrupt = 0;
+    int failed = opened < sockets;
+    for (int k = 0; k < opened; k++) {
+        /* An accepted receiver stays -1 if k_accept() failed. */
+        KTPStats stats = {0};
+        socklen_t len = sizeof(stats);
+        if (k_getsockopt(pairs[k].sender, SOL_KTP, KTP_STATS, &stats, &len) == 0) {
+            packets += stats.packets_sent;
+            retransmits += stats.retransmits;
+        }
+        len = sizeof(stats);
+        if (k_getsockopt(pairs[k].receiver, SOL_KTP, KTP_STATS, &stats, &len) == 0) {
+            recovered += stats.fec_recovered;
+        }
+        /* Latencies are compacted so a failed pair's unused tail is skipped. */
+        memmove(latencies + delivered, pairs[k].latencies, pairs[k].received * sizeof(uint64_t));
+        delivered += pairs[k].received;
+        corrupt += pairs[k].corrupt;
+        failed |= pairs[k].failed || pairs[k].corrupt > 0;
+        if (pairs[k].sender >= 0) {
+            k_close(pairs[k].sender);
+        }
+        if (pairs[k].receiver >= 0) {
+            k_close(pairs[k].receiver);
+        }
+    }
+    if (accept_mode) {
+        k_close(listener);
+    }
+    qsort(latencies, delivered, sizeof(uint64_t), compare_u64);
+
+    double megabytes = (double)delivered * msg_size / (1024 * 1024);
+    fprintf(out, "{\"msg_size\":%d,\"window\":%d,\"loss\":%.3f,\"sockets\":%d,\"fec\":%d,\"accept\":%s,\"messages\":%lu,"
+            "\"ok\":%s,\"seconds\":%.3f,\"msgs_per_sec\":%.0f,\"goodput_mbps\":%.3f,"
+            "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"retx_ratio\":%.4f,"
+            "\"fec_recovered\":%lu,\"corrupt\":%lu,\"cpu_ms_per_mb\":%.2f}\n",
+            msg_size, window, loss, sockets, fec, accept_mode ? "true" : "false", (unsigned long)delivered,
+            failed ? "false" : "true", seconds, delivered / seconds,
+            delivered * msg_size * 8 / seconds / 1e6,
+            percentile_us(latencies, delivered, 0.50), percentile_us(latencies, delivered, 0.99),
+            percentile_us(latencies, delivered, 0.999),
+            packets ? (double)retransmits / packets : 0.0, (unsigned long)recovered, (unsigned long)corrupt,
+            megabytes > 0 ? cpu / 1e6 / megabytes : 0.0);
+    fflush(out);
+
+    free(pairs);
+    free(threads);
+    free(latencies);
+}
+
+int main(int argc, char *argv[]) {
+    IntList sizes, windows, sockets;
+    FloatList losses;
+    int messages = 5000;
+    parse_ints("64,512", &sizes);
+    parse_ints("16,256", &windows);
+    parse_floats("0,0.01,0.05", &losses);
+    parse_ints("1,4", &sockets);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:w:l:n:m:f:t:a")) != -1) {
+        switch (opt) {
+        case 's': parse_ints(optarg, &sizes); break;
+        case 'w': parse_ints(optarg, &windows); break;
+        case 'l': parse_floats(optarg, &losses); break;
+        case 'n': parse_ints(optarg, &sockets); break;
+        case 'm': messages = atoi(optarg); break;
+        case 'f': fec = atoi(optarg); break;
+        case 't': fec_toggle = atoi(optarg); break;
+        case 'a': accept_mode = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-s sizes] [-w windows] [-l losses] [-n sockets] [-m messages] [-f fec] [-t n] [-a]\n"
+                    "  lists are comma separated, e.g. -s 64,512 -l 0,0.05\n"
+                    "  fec is the KTP_FEC block size of every socket, %d to adapt it\n"
+                    "  -t n switches KTP_FEC off and back on every n messages\n"
+                    "  -a accepts the receivers from one listening socket\n", argv[0], KTP_FEC_AUTO);
+            return 1;
+        }
+    }
+    for (int k = 0; k < sizes.count; k++) {
+        if (sizes.values[k] < (int)sizeof(uint64_t) || sizes.values[k] > MESSAGE_SIZE) {
+            fprintf(stderr, "message sizes must be between %zu and %d\n", sizeof(uint64_t), MESSAGE_SIZE);
+            return 1;
+        }
+    }
+
+    /* Results keep the real stdout; the engine's printf logging goes to
+     * /dev/null. A private table keeps the run apart from initksocket. */
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("ktp_bench: redirecting stdout");
+        return 1;
+    }
+    char key[32];
+    snprintf(key, sizeof(key), "%d", KTP_SHM_KEY + 1);
+    setenv("KTP_SHM_KEY", key, 0);
+
+    pthread_t worker, command;
+    init_engine();
+    for (long n = 0; n < ktp_table->nworkers; n++) {
+        pthread_create(&worker, NULL, worker_thread, (void *)n);
+    }
+    pthread_create(&command, NULL, command_thread, NULL);
+    fprintf(stderr, "engine workers: %d (%s)\n", ktp_table->nworkers,
+            ktp_table->io_backend == KTP_IO_URING ? "io_uring" : "epoll");
+
+    for (int a = 0; a < sizes.count; a++) {
+        for (int b = 0; b < windows.count; b++) {
+            for (int c = 0; c < losses.count; c++) {
+                for (int d = 0; d < sockets.count; d++) {
+                    fprintf(stderr, "size %d window %d loss %.3f sockets %d\n", sizes.values[a],
+                            windows.values[b], losses.values[c], sockets.values[d]);
+                    run(out, sizes.values[a], windows.values[b], losses.values[c],
+                        sockets.values[d], messages);
+                }
+            }
+        }
+    }
+
+    shmctl(shmget(strtol(getenv("KTP_SHM_KEY"), NULL, 0), 0, 0), IPC_RMID, NULL);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include "ksocket.h"
+
+/* Prints the counters of every open KTP socket, like ss -i: totals plus
+ * rates over each interval. Usage: ktpstat [interval_seconds [count]] */
+
+extern KTPTable *ktp_table;
+KTPSocket *ktp_socket(int id);
+
+typedef struct {
+    int open;
+    pid_t pid;
+    KTPStats stats;
+} Sample;
+
+static void take_sample(Sample *samples, int capacity) {
+    for (int id = 0; id < capacity; id++) {
+        KTPSocket *sock = ktp_socket(id);
+        socklen_t len = sizeof(KTPStats);
+        samples[id].open = !sock->is_free &&
+                           k_getsockopt(id, SOL_KTP, KTP_STATS, &samples[id].stats, &len) == 0;
+        samples[id].pid = sock->pid;
+    }
+}
+
+static void print_rtt(const KTPStats *stats) {
+    printf("\t rtt_us:");
+    for (int k = 0; k < KTP_RTT_BUCKETS; k++) {
+        if (stats->rtt_hist[k] == 0) {
+            continue;
+        }
+        if (k == KTP_RTT_BUCKETS - 1) {
+            printf(" >=%u:%lu", 1u << k, (unsigned long)stats->rtt_hist[k]);
+        } else {
+            printf(" %u-%u:%lu", 1u << k, (2u << k) - 1, (unsigned long)stats->rtt_hist[k]);
+        }
+    }
+    printf("\n");
+}
+
+static void print_socket(int id, const Sample *now, const Sample *before, double seconds) {
+    KTPSocket *sock = ktp_socket(id);
+    const KTPStats *s = &now->stats;
+    /* A socket that was not open in the previous sample, or whose id was
+     * reused meanwhile, has its rates taken from zero. */
+    KTPStats zero = {0};
+    const KTPStats *p = before->open && before->pid == now->pid &&
+                        before->stats.packets_sent <= s->packets_sent &&
+                        before->stats.packets_received <= s->packets_received ? &before->stats : &zero;
+
+    char local[INET_ADDRSTRLEN], remote[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sock->local_addr.sin_addr, local, sizeof(local));
+    inet_ntop(AF_INET, &sock->remote_addr.sin_addr, remote, sizeof(remote));
+    char cpu[16] = "";
+    if (ktp_table->workers[sock->worker].cpu >= 0) {
+        snprintf(cpu, sizeof(cpu), " cpu %d", ktp_table->workers[sock->worker].cpu);
+    }
+    printf("ktp %-5d pid %-7d worker %-2d%s %s:%u -> %s:%u\n", id, now->pid, sock->worker, cpu,
+           local, ntohs(sock->local_addr.sin_port), remote, ntohs(sock->remote_addr.sin_port));
+
+    uint64_t sent = s->packets_sent - p->packets_sent;
+    uint64_t retrans = s->retransmits - p->retransmits;
+    /* Stall time is added when a stall ends, so one that began before the
+     * interval can exceed it. */
+    double stall_pct = 100.0 * (s->stall_ns - p->stall_ns) / (seconds * 1e9);
+    if (stall_pct > 100) {
+        stall_pct = 100;
+    }
+    printf("\t sent:%lu bytes_sent:%lu retrans:%lu acks_sent:%lu acks_piggybacked:%lu"
+           " recv:%lu bytes_recv:%lu dups:%lu acks_recv:%lu drops:%lu"
+           " nospace_sent:%lu nospace_recv:%lu parity_sent:%lu fec_recovered:%lu stall_ms:%lu\n",
+           (unsigned long)s->packets_sent, (unsigned long)s->bytes_sent,
+           (unsigned long)s->retransmits, (unsigned long)s->acks_sent,
+           (unsigned long)s->acks_piggybacked,
+           (unsigned long)s->packets_received, (unsigned long)s->bytes_received,
+           (unsigned long)s->duplicates, (unsigned long)s->acks_received,
+           (unsigned long)s->drops, (unsigned long)s->nospace_sent,
+           (unsigned long)s->nospace_received, (unsigned long)s->parity_sent,
+           (unsigned long)s->fec_recovered, (unsigned long)(s->stall_ns / 1000000));
+    printf("\t send_pps:%.0f send_rate:%.1fKB/s recv_pps:%.0f recv_rate:%.1fKB/s"
+           " retrans_pct:%.1f stall_pct:%.1f\n",
+           sent / seconds, (s->bytes_sent - p->bytes_sent) / seconds / 1024,
+           (s->packets_received - p->packets_received) / seconds,
+           (s->bytes_received - p->bytes_received) / seconds / 1024,
+           sent ? 100.0 * retrans / sent : 0.0, stall_pct);
+    print_rtt(s);
+}
+
+int main(int argc, char *argv[]) {
+    int interval = argc > 1 ? atoi(argv[1]) : 1;
+    int count = argc > 2 ? atoi(argv[2]) : 0;
+    if (interval < 1) {
+        fprintf(stderr, "usage: %s [interval_seconds [count]]\n", argv[0]);
+        return 1;
+    }
+    if (init_shared_memory() == -1) {
+        perror("ktpstat: attaching to initksocket");
+        return 1;
+    }
+
+    Sample *before = NULL, *now = NULL;
+    int capacity = 0;
+    for (int round = 0; count == 0 || round < count; round++) {
+        if (ktp_table->capacity > capacity) {
+            int grown = ktp_table->capacity;
+            before = realloc(before, grown * sizeof(Sample));
+            now = realloc(now, grown * sizeof(Sample));
+            if (before == NULL || now == NULL) {
+                perror("realloc");
+                return 1;
+            }
+            memset(before + capacity, 0, (grown - capacity) * sizeof(Sample));
+            memset(now + capacity, 0, (grown - capacity) * sizeof(Sample));
+            if (capacity == 0) {
+                take_sample(before, grown);
+            }
+            capacity = grown;
+        }
+        sleep(interval);
+        take_sample(now, capacity);
+
+        int open = 0;
+        for (int id = 0; id < capacity; id++) {
+            if (now[id].open) {
+                print_socket(id, &now[id], &before[id], interval);
+                open++;
+            }
+        }
+        printf("%d open sockets\n\n", open);
+        fflush(stdout);
+
+        Sample *tmp = before;
+        before = now;
+        now = tmp;
+    }
+    return 0;
+}
@@ -0,0 +1,266 @@
+#include "ksocket.h"
+
+/* Reads the engine's per-worker trace rings and decodes them as text, one
+ * line per event in time order, or as a timeline with one row per socket.
+ * Usage: ktptrace [-l level] [-f] [-t] [-w file] [-r file] */
+
+extern KTPTable *ktp_table;
+
+#define TIMELINE_WIDTH 64
+
+/* Indexed by KTP_EV_*. rank picks the symbol a timeline cell shows when
+ * several events share it: the highest rank wins. */
+static const struct {
+    const char *name;
+    const char *window;
+    char symbol;
+    int rank;
+} event_info[] = {
+    [KTP_EV_SEND] = {"send", "swnd", '>', 1},
+    [KTP_EV_RECV] = {"recv", "rbuf", '<', 1},
+    [KTP_EV_ACK] = {"ack", "swnd", 'a', 1},
+    [KTP_EV_RETRANSMIT] = {"retransmit", "swnd", 'R', 8},
+    [KTP_EV_FAST_RETRANSMIT] = {"fast_retransmit", "swnd", 'F', 7},
+    [KTP_EV_DUPACKS] = {"dupacks", "cwnd", 'D', 6},
+    [KTP_EV_TIMEOUT] = {"timeout", "cwnd", 'T', 10},
+    [KTP_EV_DUPLICATE] = {"duplicate", "rbuf", 'd', 3},
+    [KTP_EV_DROP] = {"drop", "queued", 'x', 9},
+    [KTP_EV_QUEUE_FULL] = {"queue_full", "queued", 'q', 9},
+    [KTP_EV_MALFORMED] = {"malformed", "bytes", 'm', 2},
+    [KTP_EV_NOSPACE] = {"nospace", "rbuf", 'N', 5},
+    [KTP_EV_WINDOW_UPDATE] = {"window_update", "free", 'W', 4},
+    [KTP_EV_UNKNOWN_ACK] = {"unknown_ack", "swnd", 'u', 2},
+    [KTP_EV_PARITY] = {"parity", "block", 'p', 1},
+    [KTP_EV_FEC_RECOVER] = {"fec_recover", "rbuf", 'r', 5},
+};
+
+#define EVENT_TYPES (int)(sizeof(event_info) / sizeof(event_info[0]))
+
+typedef struct {
+    KTPTraceEvent *events;
+    int count;
+    int capacity;
+} EventList;
+
+static void append(EventList *list, const KTPTraceEvent *event) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : KTP_TRACE_EVENTS;
+        list->events = realloc(list->events, list->capacity * sizeof(KTPTraceEvent));
+        if (list->events == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    list->events[list->count++] = *event;
+}
+
+/* Copies every event written to ring w since next[w]. The worker keeps
+ * writing meanwhile, so once the copy is done head is read again and any
+ * event whose slot may have been reused during the copy is dropped, along
+ * with those overwritten before the copy began. Returns how many were lost. */
+static uint64_t capture_ring(const KTPTraceRing *ring, uint64_t *next, EventList *list) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t from = head > KTP_TRACE_EVENTS && head - KTP_TRACE_EVENTS > *next ? head - KTP_TRACE_EVENTS : *next;
+    int start = list->count;
+    for (uint64_t n = from; n < head; n++) {
+        append(list, &ring->events[n % KTP_TRACE_EVENTS]);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t valid = after >= KTP_TRACE_EVENTS ? after - KTP_TRACE_EVENTS + 1 : 0;
+    uint64_t lost = from - *next;
+    if (valid > from) {
+        uint64_t torn = valid - from < head - from ? valid - from : head - from;
+        memmove(list->events + start, list->events + start + torn,
+                (list->count - start - torn) * sizeof(KTPTraceEvent));
+        list->count -= torn;
+        lost += torn;
+    }
+    *next = head;
+    return lost;
+}
+
+static int compare_time(const void *a, const void *b) {
+    const KTPTraceEvent *x = a, *y = b;
+    return x->time_ns < y->time_ns ? -1 : x->time_ns > y->time_ns;
+}
+
+static void print_event(const KTPTraceEvent *event, uint64_t base) {
+    if (event->type < EVENT_TYPES && event_info[event->type].name != NULL) {
+        printf("%12.6f worker %-2u ktp %-5d %-15s seq %-10u %s %u\n", (event->time_ns - base) / 1e9,
+               event->worker, event->sockfd, event_info[event->type].name, event->seq,
+               event_info[event->type].window, event->window);
+    } else {
+        printf("%12.6f worker %-2u ktp %-5d event %u seq %u window %u\n", (event->time_ns - base) / 1e9,
+               event->worker, event->sockfd, event->type, event->seq, event->window);
+    }
+}
+
+/* One row per socket, the captured span cut into TIMELINE_WIDTH cells;
+ * each cell shows its highest-ranked event. */
+static void print_timeline(const KTPTraceEvent *events, int count) {
+    if (count == 0) {
+        return;
+    }
+    uint64_t base = events[0].time_ns;
+    uint64_t span = events[count - 1].time_ns - base + 1;
+    int max_sock = 0;
+    for (int k = 0; k < count; k++) {
+        if (events[k].sockfd > max_sock) {
+            max_sock = events[k].sockfd;
+        }
+    }
+    char (*rows)[TIMELINE_WIDTH + 1] = calloc(max_sock + 1, sizeof(*rows));
+    if (rows == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int k = 0; k < count; k++) {
+        const KTPTraceEvent *event = &events[k];
+        if (event->sockfd < 0 || event->type >= EVENT_TYPES || event_info[event->type].name == NULL) {
+            continue;
+        }
+        char *row = rows[event->sockfd];
+        int cell = (event->time_ns - base) * TIMELINE_WIDTH / span;
+        int rank = 0;
+        for (int t = 1; t < EVENT_TYPES; t++) {
+            if (row[cell] == event_info[t].symbol) {
+                rank = event_info[t].rank;
+            }
+        }
+        if (event_info[event->type].rank > rank) {
+            row[cell] = event_info[event->type].symbol;
+        }
+    }
+
+    printf("%.6f s, %.3f ms per column\n", span / 1e9, span / 1e6 / TIMELINE_WIDTH);
+    for (int id = 0; id <= max_sock; id++) {
+        int used = 0;
+        for (int c = 0; c < TIMELINE_WIDTH; c++) {
+            if (rows[id][c] == 0) {
+                rows[id][c] = ' ';
+            } else {
+                used = 1;
+            }
+        }
+        if (used) {
+            printf("ktp %-5d |%s|\n", id, rows[id]);
+        }
+    }
+    printf("legend:");
+    for (int t = 1; t < EVENT_TYPES; t++) {
+        printf(" %c %s", event_info[t].symbol, event_info[t].name);
+    }
+    printf("\n");
+    free(rows);
+}
+
+int main(int argc, char *argv[]) {
+    int level = -1, follow = 0, timeline = 0;
+    const char *write_path = NULL, *read_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:ftw:r:")) != -1) {
+        switch (opt) {
+        case 'l': level = atoi(optarg); break;
+        case 'f': follow = 1; break;
+        case 't': timeline = 1; break;
+        case 'w': write_path = optarg; break;
+        case 'r': read_path = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-l level] [-f] [-t] [-w file] [-r file]\n"
+                    "  -l  set the engine's trace level: %d off, %d losses, %d every packet\n"
+                    "  -f  follow the rings, printing events as they arrive\n"
+                    "  -t  print a timeline per socket instead of one line per event\n"
+                    "  -w  save the captured events to file instead of decoding them\n"
+                    "  -r  decode events saved with -w instead of the engine's\n",
+                    argv[0], KTP_TRACE_OFF, KTP_TRACE_LOSS, KTP_TRACE_ALL);
+            return 1;
+        }
+    }
+
+    EventList list = {0};
+    if (read_path != NULL) {
+        FILE *in = fopen(read_path, "rb");
+        if (in == NULL) {
+            perror(read_path);
+            return 1;
+        }
+        KTPTraceEvent event;
+        while (fread(&event, sizeof(event), 1, in) == 1) {
+            append(&list, &event);
+        }
+        fclose(in);
+        if (timeline) {
+            print_timeline(list.events, list.count);
+        } else {
+            for (int k = 0; k < list.count; k++) {
+                print_event(&list.events[k], list.events[0].time_ns);
+            }
+        }
+        return 0;
+    }
+
+    if (init_shared_memory() == -1) {
+        perror("ktptrace: attaching to initksocket");
+        return 1;
+    }
+    if (level >= 0) {
+        __atomic_store_n(&ktp_table->trace_level, level, __ATOMIC_RELAXED);
+        if (!follow && !timeline && write_path == NULL) {
+            return 0;
+        }
+    }
+    KTPTraceRing *rings = shmat(ktp_table->trace_shmid, NULL, SHM_RDONLY);
+    if (rings == (void *)-1) {
+        perror("ktptrace: attaching to the trace rings");
+        return 1;
+    }
+    int nworkers = ktp_table->nworkers;
+    uint64_t *next = calloc(nworkers, sizeof(uint64_t));
+    if (next == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    FILE *out = NULL;
+    if (write_path != NULL && (out = fopen(write_path, "wb")) == NULL) {
+        perror(write_path);
+        return 1;
+    }
+
+    uint64_t base = 0;
+    do {
+        list.count = 0;
+        uint64_t lost = 0;
+        for (int w = 0; w < nworkers; w++) {
+            lost += capture_ring(&rings[w], &next[w], &list);
+        }
+        if (lost > 0) {
+            fprintf(stderr, "ktptrace: %lu events overwritten before they were read\n", (unsigned long)lost);
+        }
+        /* Each ring is in time order already; workers interleave. */
+        qsort(list.events, list.count, sizeof(KTPTraceEvent), compare_time);
+        if (list.count > 0 && base == 0) {
+            base = list.events[0].time_ns;
+        }
+
+        if (out != NULL) {
+            if (fwrite(list.events, sizeof(KTPTraceEvent), list.count, out) != (size_t)list.count ||
+                fflush(out) != 0) {
+                perror(write_path);
+                return 1;
+            }
+        } else if (timeline) {
+            print_timeline(list.events, list.count);
+        } else {
+            for (int k = 0; k < list.count; k++) {
+                print_event(&list.events[k], base);
+            }
+        }
+        fflush(stdout);
+        if (follow) {
+            usleep(100000);
+        }
+    } while (follow);
+    return 0;
+}
@@ -30,76 +30,32 @@ int main() {
         exit(1);
     }
 
-    FILE *file = fopen("large_file.txt", "rb");
-    if (file == NULL) {
-        perror("fopen");
-        k_close(sockfd);
-        exit(1);
-    }
-
-    char buffer[MESSAGE_SIZE];
-    size_t bytes_read;
-    int total_transmissions = 0;
-    int total_messages = 0;
-    
     printf("Sending file...\n");
 
-    while ((bytes_read = fread(buffer, 1, MESSAGE_SIZE, file)) > 0) {
-        buffer[bytes_read] = '\0';
-        
-        int retry_count = 0;
-        while (retry_count < 100) {
-            ssize_t bytes_sent = k_sendto(sockfd, buffer, MESSAGE_SIZE, 0, 
-                                 (struct sockaddr *)&remote_addr, sizeof(remote_addr));
-            
-            if (bytes_sent < 0) {
-                if (errno == ENOSPACE) {
-                    usleep(100000); 
-                    retry_count++;
-                } else {
-                    perror("k_sendto");
-                    k_close(sockfd);
-                    fclose(file);
-                    exit(1);
-                }
-            } else {
-                total_transmissions++;
-                total_messages++;
-                break;
-            }
-        }
-        
-        if (retry_count >= 100) {
-            fprintf(stderr, "Failed to send after multiple retries\n");
-            k_close(sockfd);
-            fclose(file);
-            exit(1);
-        }
-        
-        usleep(10000); 
+    int window = 256;
+    if (k_setsockopt(sockfd, SOL_KTP, KTP_SNDWND, &window, sizeof(window)) < 0) {
+        perror("k_setsockopt");
     }
 
-    strcpy(buffer, "##########");
-    while (k_sendto(sockfd, buffer, strlen(buffer) + 1, 0, 
-           (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0) {
-        if (errno == ENOSPACE) {
-            usleep(100000); 
-        } else {
-            perror("k_sendto EOF marker");
-            k_close(sockfd);
-            fclose(file);
-            exit(1);
-        }
+    KTPTransferStats stats;
+    if (k_sendfile(sockfd, "large_file.txt", &stats) < 0) {
+        perror("k_sendfile");
+        k_close(sockfd);
+        exit(1);
     }
-    
-    sleep(5);
 
-    fclose(file);
+    KTPStats counters;
+    socklen_t counters_len = sizeof(counters);
+    k_getsockopt(sockfd, SOL_KTP, KTP_STATS, &counters, &counters_len);
+    uint64_t messages = counters.packets_sent - counters.retransmits;
 
-    printf("Total transmissions: %d\n", total_transmissions);
-    printf("Total messages: %d\n", total_messages);
-    printf("Average transmissions per message: %.2f\n", (float)total_transmissions / total_messages);
+    printf("Bytes sent: %lu\n", (unsigned long)stats.bytes);
+    printf("Throughput: %.1f KB/s\n", stats.bytes_per_sec / 1024);
+    printf("Total transmissions: %lu\n", (unsigned long)counters.packets_sent);
+    printf("Total messages: %lu\n", (unsigned long)messages);
+    printf("Average transmissions per message: %.2f\n",
+           (float)counters.packets_sent / messages);
 
     k_close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
@@ -29,61 +29,22 @@ int main() {
         exit(1);
     }
 
-    FILE *file = fopen("received_file.txt", "wb");
-    if (file == NULL) {
-        perror("fopen");
+    printf("Waiting to receive file...\n");
+
+    int window = 256;
+    if (k_setsockopt(sockfd, SOL_KTP, KTP_RCVWND, &window, sizeof(window)) < 0) {
+        perror("k_setsockopt");
+    }
+
+    KTPTransferStats stats;
+    if (k_recvfile(sockfd, "received_file.txt", &stats) < 0) {
+        perror("k_recvfile");
         k_close(sockfd);
         exit(1);
     }
 
-    char buffer[MESSAGE_SIZE];
-    struct sockaddr_in src_addr;
-    socklen_t src_len = sizeof(src_addr);
-    ssize_t bytes_received;
-    int total_packets = 0;
-    unsigned char expected_seq = 0;
-
-
-    printf("Waiting to receive file...\n");
-
-    while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        errno = 0;
-    
-        bytes_received = k_recvfrom(sockfd, buffer, MESSAGE_SIZE, 0,
-                                   (struct sockaddr *)&src_addr, &src_len);
-    
-        if (bytes_received < 0) {
-            if (errno == ENOMESSAGE) {
-                usleep(50000); 
-                continue;
-            } else {
-                perror("k_recvfrom");
-                printf("Errno: %d\n", errno);
-                continue;
-            }
-        }
-        
-        if (bytes_received >= 10 && strcmp(buffer, "##########") == 0) {
-            printf("End of file marker received\n");
-            break;
-        }
-    
-        size_t written = fwrite(buffer, 1, bytes_received, file);
-        if (written != bytes_received) {
-            perror("fwrite");
-            printf("Written: %zu, Expected: %zd\n", written, bytes_received);
-            break;
-        }
-        fflush(file);  
-        total_packets++;
-    
-        if (total_packets % 10 == 0) {
-            printf("Received %d packets so far\n", total_packets);
-        }
-    }
-    fclose(file);
-    printf("File transfer complete. Received %d packets.\n", total_packets);
+    printf("File transfer complete. Received %lu bytes (%.1f KB/s).\n",
+           (unsigned long)stats.bytes, stats.bytes_per_sec / 1024);
     k_close(sockfd);
     return 0;
-}
\ No newline at end of file
+}